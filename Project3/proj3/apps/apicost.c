@@ -0,0 +1,42 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS      1000000
+
+// Times VM calls that never block, VMTickCount and an uncontended
+// VMMutexAcquire/VMMutexRelease pair, to show the cost of entering and
+// leaving the VM critical section.
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMMutexID Mutex;
+    TVMTick Tick;
+    int Iterations = DEFAULT_ITERATIONS;
+    struct timespec StartTime, EndTime;
+
+    if(1 < argc){
+        Iterations = atoi(argv[1]);
+        if(0 >= Iterations){
+            Iterations = DEFAULT_ITERATIONS;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < Iterations; Index++){
+        VMTickCount(&Tick);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VMPrint("VMTickCount %lld ns per call\n", ElapsedNS(&StartTime, &EndTime) / Iterations);
+
+    VMMutexCreate(&Mutex);
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < Iterations; Index++){
+        VMMutexAcquire(Mutex, VM_TIMEOUT_INFINITE);
+        VMMutexRelease(Mutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VMPrint("VMMutexAcquire/VMMutexRelease %lld ns per pair\n", ElapsedNS(&StartTime, &EndTime) / Iterations);
+}
+
@@ -0,0 +1,114 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_READERS         256
+#define DEFAULT_ROUNDS          20
+#define MAX_READERS             1024
+
+// Keeps many reader threads blocked on FIFOs while the main thread wakes
+// them one at a time, to measure I/O server wakeup latency under load.
+typedef struct{
+    int DIndex;
+    int DFileDescriptor;
+} SReader, *SReaderRef;
+
+SReader Readers[MAX_READERS];
+struct timespec WriteTimes[MAX_READERS];
+volatile long long TotalLatencyNS = 0;
+volatile long long MaxLatencyNS = 0;
+volatile int Wakeups = 0;
+int Rounds = DEFAULT_ROUNDS;
+
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMThreadReader(void *param){
+    SReaderRef Reader = (SReaderRef)param;
+    struct timespec WakeTime;
+    char Byte;
+    int Length;
+    long long Latency;
+
+    for(int Round = 0; Round < Rounds; Round++){
+        Length = 1;
+        if((VM_STATUS_SUCCESS != VMFileRead(Reader->DFileDescriptor, &Byte, &Length))||(1 != Length)){
+            VMPrint("Reader %d failed to read\n", Reader->DIndex);
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &WakeTime);
+        Latency = ElapsedNS(&WriteTimes[Reader->DIndex], &WakeTime);
+        TotalLatencyNS += Latency;
+        if(Latency > MaxLatencyNS){
+            MaxLatencyNS = Latency;
+        }
+        Wakeups++;
+    }
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    char FileName[64];
+    char Byte = 'x';
+    int ReaderCount = DEFAULT_READERS, Length;
+    struct timespec StartTime, EndTime;
+
+    if(1 < argc){
+        ReaderCount = atoi(argv[1]);
+        if((0 >= ReaderCount)||(MAX_READERS < ReaderCount)){
+            ReaderCount = DEFAULT_READERS;
+        }
+    }
+    if(2 < argc){
+        Rounds = atoi(argv[2]);
+        if(0 >= Rounds){
+            Rounds = DEFAULT_ROUNDS;
+        }
+    }
+    for(int Index = 0; Index < ReaderCount; Index++){
+        snprintf(FileName, sizeof(FileName), "blockedreaders.%d.fifo", Index);
+        unlink(FileName);
+        if(0 != mkfifo(FileName, 0600)){
+            VMPrint("Failed to create %s\n", FileName);
+            return;
+        }
+        Readers[Index].DIndex = Index;
+        // O_RDWR keeps the open from blocking and the FIFO from hanging up
+        if(VM_STATUS_SUCCESS != VMFileOpen(FileName, O_RDWR, 0600, &Readers[Index].DFileDescriptor)){
+            VMPrint("Failed to open %s\n", FileName);
+            return;
+        }
+        VMThreadCreate(VMThreadReader, &Readers[Index], 0x100000, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    // Every reader is now blocked in VMFileRead
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Round = 0; Round < Rounds; Round++){
+        for(int Index = 0; Index < ReaderCount; Index++){
+            clock_gettime(CLOCK_MONOTONIC, &WriteTimes[Index]);
+            Length = 1;
+            VMFileWrite(Readers[Index].DFileDescriptor, &Byte, &Length);
+        }
+    }
+    while(Wakeups < ReaderCount * Rounds){
+        VMThreadSleep(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    for(int Index = 0; Index < ReaderCount; Index++){
+        VMFileClose(Readers[Index].DFileDescriptor);
+        snprintf(FileName, sizeof(FileName), "blockedreaders.%d.fifo", Index);
+        unlink(FileName);
+    }
+    VMPrint("%d readers, %d wakeups in %lld us\n", ReaderCount, Wakeups, ElapsedNS(&StartTime, &EndTime) / 1000);
+    VMPrint("Wakeup latency avg %lld ns, max %lld ns\n", TotalLatencyNS / Wakeups, MaxLatencyNS);
+}
+
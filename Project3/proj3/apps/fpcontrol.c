@@ -0,0 +1,59 @@
+#include "VirtualMachine.h"
+#include <fenv.h>
+#include <stdlib.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_ROUNDS          1000
+#define THREADS                 2
+
+// Run with a vm built with CONTEXT_REGISTERS=TRUE. Main and two threads
+// take turns, each with its own rounding mode, and every one of them has to
+// find its own mode again after each switch. setjmp contexts leave the
+// floating point control state with the host thread, so they fail this.
+int Rounds = DEFAULT_ROUNDS;
+volatile int Mismatches = 0;
+volatile int Done = 0;
+
+void CheckRounding(int mode){
+    if(fegetround() != mode){
+        Mismatches++;
+        fesetround(mode);
+    }
+}
+
+void VMThreadRounding(void *param){
+    int Mode = *(int *)param;
+
+    fesetround(Mode);
+    for(int Round = 0; Round < Rounds; Round++){
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+        CheckRounding(Mode);
+    }
+    Done++;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadIDs[THREADS];
+    int Modes[THREADS] = {FE_UPWARD, FE_DOWNWARD};
+
+    if(1 < argc){
+        Rounds = atoi(argv[1]);
+        if(0 >= Rounds){
+            Rounds = DEFAULT_ROUNDS;
+        }
+    }
+    fesetround(FE_TOWARDZERO);
+    for(int Index = 0; Index < THREADS; Index++){
+        VMThreadCreate(VMThreadRounding, &Modes[Index], 0x10000, VM_THREAD_PRIORITY_NORMAL, &ThreadIDs[Index]);
+        VMThreadActivate(ThreadIDs[Index]);
+    }
+    while(THREADS > Done){
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+        CheckRounding(FE_TOWARDZERO);
+    }
+    fesetround(FE_TONEAREST);
+    VMPrint("%d rounds, %d switches found another thread's rounding mode\n", Rounds, Mismatches);
+}
@@ -0,0 +1,102 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_SPIN_TICKS      50
+#define DEFAULT_HOLDER_WORK     100000000
+#define SPINNERS                3
+
+// The classic inversion: a LOW thread takes a mutex and has some work left
+// to do when a HIGH thread blocks on it, while NORMAL threads keep the CPU
+// busy for a long time. Without priority inheritance HIGH waits for the
+// spinners, with it LOW finishes at HIGH priority and HIGH barely waits.
+// A second mutex chains the inheritance through a middle thread.
+TVMMutexID Inner, Outer;
+int SpinTicks = DEFAULT_SPIN_TICKS;
+long long HolderWork = DEFAULT_HOLDER_WORK;
+volatile int Done = 0;
+TVMTick HighWait;
+
+void VMThreadHolder(void *param){
+    volatile long long Work = 0;
+
+    VMMutexAcquire(Inner, VM_TIMEOUT_INFINITE);
+    for(long long Index = 0; Index < HolderWork; Index++){
+        Work++;
+    }
+    VMMutexRelease(Inner);
+    Done++;
+}
+
+// Holds Outer while blocked on Inner, so HIGH's priority has to pass
+// through it to reach the holder
+void VMThreadMiddle(void *param){
+    VMMutexAcquire(Outer, VM_TIMEOUT_INFINITE);
+    VMMutexAcquire(Inner, VM_TIMEOUT_INFINITE);
+    VMMutexRelease(Inner);
+    VMMutexRelease(Outer);
+    Done++;
+}
+
+void VMThreadHigh(void *param){
+    TVMTick Start, End;
+
+    VMTickCount(&Start);
+    VMMutexAcquire(Outer, VM_TIMEOUT_INFINITE);
+    VMTickCount(&End);
+    HighWait = End - Start;
+    VMMutexRelease(Outer);
+    Done++;
+}
+
+void VMThreadSpinner(void *param){
+    TVMTick Start, Now;
+
+    VMTickCount(&Start);
+    do{
+        VMTickCount(&Now);
+    }while(Now - Start < (TVMTick)SpinTicks);
+    Done++;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+
+    if(1 < argc){
+        SpinTicks = atoi(argv[1]);
+        if(0 >= SpinTicks){
+            SpinTicks = DEFAULT_SPIN_TICKS;
+        }
+    }
+    if(2 < argc){
+        HolderWork = atoll(argv[2]);
+        if(0 >= HolderWork){
+            HolderWork = DEFAULT_HOLDER_WORK;
+        }
+    }
+    VMMutexCreate(&Inner);
+    VMMutexCreate(&Outer);
+    // Main outranks LOW, so the holder only gets going while main sleeps
+    VMThreadCreate(VMThreadHolder, NULL, 0x10000, VM_THREAD_PRIORITY_LOW, &ThreadID);
+    VMThreadActivate(ThreadID);
+    VMThreadSleep(1);
+    // The middle thread is queued behind the holder, it runs from the tick
+    VMThreadCreate(VMThreadMiddle, NULL, 0x10000, VM_THREAD_PRIORITY_LOW, &ThreadID);
+    VMThreadActivate(ThreadID);
+    VMThreadSleep(2);
+    for(int Index = 0; Index < SPINNERS; Index++){
+        VMThreadCreate(VMThreadSpinner, NULL, 0x10000, VM_THREAD_PRIORITY_NORMAL, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    VMThreadCreate(VMThreadHigh, NULL, 0x10000, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+    VMThreadActivate(ThreadID);
+    while(Done < SPINNERS + 3){
+        VMThreadSleep(1);
+    }
+    VMPrint("%d NORMAL spinners for %d ticks each\n", SPINNERS, SpinTicks);
+    VMPrint("HIGH waited %u ticks for a mutex chained behind LOW\n", HighWait);
+}
+
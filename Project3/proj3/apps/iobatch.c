@@ -0,0 +1,60 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_THREADS         16
+#define DEFAULT_OPERATIONS      1000
+#define MAX_THREADS             256
+
+// Has many threads issue VMFileSeek at once so requests pile up within a
+// tick. Run with VM_MACHINE_STATISTICS=1 to see signals per operation.
+volatile int Finished = 0;
+int Operations = DEFAULT_OPERATIONS;
+int FileDescriptor;
+
+void VMThreadIssuer(void *param){
+    int Offset;
+
+    for(int Index = 0; Index < Operations; Index++){
+        VMFileSeek(FileDescriptor, Index, 0, &Offset);
+    }
+    Finished++;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    int ThreadCount = DEFAULT_THREADS;
+    struct timespec StartTime, EndTime;
+    long long ElapsedNS;
+
+    if(1 < argc){
+        ThreadCount = atoi(argv[1]);
+        if((0 >= ThreadCount)||(MAX_THREADS < ThreadCount)){
+            ThreadCount = DEFAULT_THREADS;
+        }
+    }
+    if(2 < argc){
+        Operations = atoi(argv[2]);
+        if(0 >= Operations){
+            Operations = DEFAULT_OPERATIONS;
+        }
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("iobatch.txt", O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+        VMPrint("Failed to open iobatch.txt\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < ThreadCount; Index++){
+        VMThreadCreate(VMThreadIssuer, NULL, 0x100000, VM_THREAD_PRIORITY_NORMAL, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    while(Finished < ThreadCount){
+        VMThreadSleep(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VMFileClose(FileDescriptor);
+    ElapsedNS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000000LL + (EndTime.tv_nsec - StartTime.tv_nsec);
+    VMPrint("%d threads, %d operations in %lld us, %lld ns per operation\n", ThreadCount, ThreadCount * Operations, ElapsedNS / 1000, ElapsedNS / (ThreadCount * Operations));
+}
+
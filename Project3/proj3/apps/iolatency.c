@@ -0,0 +1,34 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS      10000
+
+// Measures Machine layer round trip latency with VMFileSeek, which does no
+// data transfer. Compare transports with VM_MACHINE_TRANSPORT=msgq.
+void VMMain(int argc, char *argv[]){
+    int FileDescriptor, Offset, Iterations = DEFAULT_ITERATIONS;
+    struct timespec StartTime, EndTime;
+    long long ElapsedNS;
+
+    if(1 < argc){
+        Iterations = atoi(argv[1]);
+        if(0 >= Iterations){
+            Iterations = DEFAULT_ITERATIONS;
+        }
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("iolatency.txt", O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+        VMPrint("Failed to open iolatency.txt\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < Iterations; Index++){
+        VMFileSeek(FileDescriptor, 0, 0, &Offset);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VMFileClose(FileDescriptor);
+    ElapsedNS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000000LL + (EndTime.tv_nsec - StartTime.tv_nsec);
+    VMPrint("%d round trips in %lld us, %lld ns per round trip\n", Iterations, ElapsedNS / 1000, ElapsedNS / Iterations);
+}
+
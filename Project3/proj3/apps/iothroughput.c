@@ -0,0 +1,65 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_BLOCK_SIZE      0x100000
+
+// Copies src to dest with VMFileRead/VMFileWrite of blocksize bytes and
+// reports the sequential throughput. Run vm with -s at least blocksize to
+// keep each block a single Machine request.
+void VMMain(int argc, char *argv[]){
+    int InputDescriptor, OutputDescriptor, BlockSize = DEFAULT_BLOCK_SIZE;
+    int Length, TotalBytes = 0;
+    char *Buffer;
+    struct timespec StartTime, EndTime;
+    long long ElapsedUS;
+
+    if((3 != argc)&&(4 != argc)){
+        VMPrint("VMMain invalid number of arguments. Should be iothroughput src dest [blocksize]\n");
+        return;
+    }
+    if(4 == argc){
+        BlockSize = atoi(argv[3]);
+        if(0 >= BlockSize){
+            BlockSize = DEFAULT_BLOCK_SIZE;
+        }
+    }
+    Buffer = (char *)malloc(BlockSize);
+    if(VM_STATUS_SUCCESS != VMFileOpen(argv[1], O_RDONLY, 0644, &InputDescriptor)){
+        VMPrint("Failed to open %s\n", argv[1]);
+        free(Buffer);
+        return;
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen(argv[2], O_CREAT | O_TRUNC | O_RDWR, 0644, &OutputDescriptor)){
+        VMPrint("Failed to open %s\n", argv[2]);
+        VMFileClose(InputDescriptor);
+        free(Buffer);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    do{
+        Length = BlockSize;
+        if(VM_STATUS_SUCCESS != VMFileRead(InputDescriptor, Buffer, &Length)){
+            VMPrint("VMFileRead failed\n");
+            break;
+        }
+        if(Length){
+            if(VM_STATUS_SUCCESS != VMFileWrite(OutputDescriptor, Buffer, &Length)){
+                VMPrint("VMFileWrite failed\n");
+                break;
+            }
+            TotalBytes += Length;
+        }
+    }while(Length);
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VMFileClose(OutputDescriptor);
+    VMFileClose(InputDescriptor);
+    free(Buffer);
+    ElapsedUS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000LL + (EndTime.tv_nsec - StartTime.tv_nsec) / 1000;
+    if(0 >= ElapsedUS){
+        ElapsedUS = 1;
+    }
+    VMPrint("Copied %d bytes in %lld us, %lld MB/s\n", TotalBytes, ElapsedUS, (long long)TotalBytes / ElapsedUS);
+}
+
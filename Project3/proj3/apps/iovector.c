@@ -0,0 +1,83 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RECORDS         1000
+#define DEFAULT_FRAGMENTS       8
+#define FRAGMENT_SIZE           64
+#define MAX_FRAGMENTS           64
+
+// Writes records made of several small fragments, once with a VMFileWrite
+// per fragment and once with a single VMFileWriteV per record, then reads
+// them back with VMFileReadV and checks the contents.
+char Fragments[MAX_FRAGMENTS][FRAGMENT_SIZE];
+char Readback[MAX_FRAGMENTS][FRAGMENT_SIZE];
+
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMMain(int argc, char *argv[]){
+    SVMIOVector Vector[MAX_FRAGMENTS];
+    int FileDescriptor, Length, Records = DEFAULT_RECORDS, FragmentCount = DEFAULT_FRAGMENTS;
+    struct timespec StartTime, EndTime;
+    long long SingleNS, VectorNS;
+
+    if(1 < argc){
+        Records = atoi(argv[1]);
+        if(0 >= Records){
+            Records = DEFAULT_RECORDS;
+        }
+    }
+    if(2 < argc){
+        FragmentCount = atoi(argv[2]);
+        if((0 >= FragmentCount)||(MAX_FRAGMENTS < FragmentCount)){
+            FragmentCount = DEFAULT_FRAGMENTS;
+        }
+    }
+    for(int Index = 0; Index < FragmentCount; Index++){
+        memset(Fragments[Index], 'a' + Index % 26, FRAGMENT_SIZE);
+        Vector[Index].DData = Fragments[Index];
+        Vector[Index].DLength = FRAGMENT_SIZE;
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("iovector.txt", O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+        VMPrint("Failed to open iovector.txt\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Record = 0; Record < Records; Record++){
+        for(int Index = 0; Index < FragmentCount; Index++){
+            Length = FRAGMENT_SIZE;
+            VMFileWrite(FileDescriptor, Fragments[Index], &Length);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    SingleNS = ElapsedNS(&StartTime, &EndTime);
+
+    VMFileSeek(FileDescriptor, 0, SEEK_SET, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Record = 0; Record < Records; Record++){
+        VMFileWriteV(FileDescriptor, Vector, FragmentCount, &Length);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    VectorNS = ElapsedNS(&StartTime, &EndTime);
+
+    VMFileSeek(FileDescriptor, 0, SEEK_SET, NULL);
+    for(int Index = 0; Index < FragmentCount; Index++){
+        Vector[Index].DData = Readback[Index];
+    }
+    for(int Record = 0; Record < Records; Record++){
+        if((VM_STATUS_SUCCESS != VMFileReadV(FileDescriptor, Vector, FragmentCount, &Length))||(FragmentCount * FRAGMENT_SIZE != Length)||memcmp(Readback, Fragments, FragmentCount * FRAGMENT_SIZE)){
+            VMPrint("Record %d did not read back\n", Record);
+            break;
+        }
+    }
+    VMFileClose(FileDescriptor);
+    VMPrint("%d records of %d x %d bytes\n", Records, FragmentCount, FRAGMENT_SIZE);
+    VMPrint("VMFileWrite per fragment %lld ns per record\n", SingleNS / Records);
+    VMPrint("VMFileWriteV per record  %lld ns per record\n", VectorNS / Records);
+}
+
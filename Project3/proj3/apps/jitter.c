@@ -0,0 +1,55 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLES         1000
+#define MAX_SAMPLES             100000
+
+// Spins on VMTickCount and timestamps every tick as it arrives, then reports
+// how far the spacing between ticks strays from the configured period.
+long long Deviations[MAX_SAMPLES];
+
+int CompareDeviations(const void *left, const void *right){
+    long long Left = *(const long long *)left;
+    long long Right = *(const long long *)right;
+
+    return Left < Right ? -1 : Left > Right;
+}
+
+void VMMain(int argc, char *argv[]){
+    int Samples = DEFAULT_SAMPLES, TickUS, Index = -1;
+    TVMTick LastTick, CurrentTick;
+    struct timespec LastTime, CurrentTime;
+    long long PeriodNS, Interval;
+
+    if(1 < argc){
+        Samples = atoi(argv[1]);
+        if((0 >= Samples)||(MAX_SAMPLES < Samples)){
+            Samples = DEFAULT_SAMPLES;
+        }
+    }
+    VMTickUS(&TickUS);
+    PeriodNS = TickUS * 1000LL;
+    VMTickCount(&LastTick);
+    clock_gettime(CLOCK_MONOTONIC, &LastTime);
+    // The first tick seen only starts the clock
+    while(Index < Samples){
+        VMTickCount(&CurrentTick);
+        if(CurrentTick == LastTick){
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &CurrentTime);
+        if(0 <= Index){
+            Interval = (CurrentTime.tv_sec - LastTime.tv_sec) * 1000000000LL + (CurrentTime.tv_nsec - LastTime.tv_nsec);
+            // Missed ticks still count against the period they should fill
+            Interval -= PeriodNS * (long long)(CurrentTick - LastTick);
+            Deviations[Index] = Interval < 0 ? -Interval : Interval;
+        }
+        Index++;
+        LastTick = CurrentTick;
+        LastTime = CurrentTime;
+    }
+    qsort(Deviations, Samples, sizeof(long long), CompareDeviations);
+    VMPrint("%d ticks of %d us, deviation p50 %lld ns, p99 %lld ns, max %lld ns\n", Samples, TickUS, Deviations[Samples / 2], Deviations[(Samples * 99) / 100], Deviations[Samples - 1]);
+}
+
@@ -0,0 +1,83 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_WAITERS         100
+#define DEFAULT_TIMEOUT         5
+#define DEFAULT_HOLD            10
+
+// The main thread holds a mutex for a number of ticks while waiters try to
+// acquire it with a timeout. Waiters whose timeout is shorter than the hold
+// should all fail close to their deadline, the rest get the mutex in turn.
+// Results are counted under a second mutex.
+TVMMutexID Mutex, CountMutex;
+int Waiters = DEFAULT_WAITERS;
+int Timeout = DEFAULT_TIMEOUT;
+int Hold = DEFAULT_HOLD;
+int Acquired = 0;
+int TimedOut = 0;
+TVMTick LongestWait = 0;
+
+void VMThreadWaiter(void *param){
+    TVMTick Start, End;
+    TVMStatus Status;
+
+    VMTickCount(&Start);
+    Status = VMMutexAcquire(Mutex, Timeout);
+    VMTickCount(&End);
+    if(VM_STATUS_SUCCESS == Status){
+        VMMutexRelease(Mutex);
+    }
+    VMMutexAcquire(CountMutex, VM_TIMEOUT_INFINITE);
+    if(End - Start > LongestWait){
+        LongestWait = End - Start;
+    }
+    if(VM_STATUS_SUCCESS == Status){
+        Acquired++;
+    }
+    else{
+        TimedOut++;
+    }
+    VMMutexRelease(CountMutex);
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+
+    if(1 < argc){
+        Waiters = atoi(argv[1]);
+        if(0 >= Waiters){
+            Waiters = DEFAULT_WAITERS;
+        }
+    }
+    if(2 < argc){
+        Timeout = atoi(argv[2]);
+        if(0 >= Timeout){
+            Timeout = DEFAULT_TIMEOUT;
+        }
+    }
+    if(3 < argc){
+        Hold = atoi(argv[3]);
+        if(0 >= Hold){
+            Hold = DEFAULT_HOLD;
+        }
+    }
+    VMMutexCreate(&Mutex);
+    VMMutexCreate(&CountMutex);
+    VMMutexAcquire(Mutex, VM_TIMEOUT_INFINITE);
+    for(int Index = 0; Index < Waiters; Index++){
+        VMThreadCreate(VMThreadWaiter, NULL, 0x10000, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    VMThreadSleep(Hold);
+    VMMutexRelease(Mutex);
+    while(Acquired + TimedOut < Waiters){
+        VMThreadSleep(1);
+    }
+    VMPrint("%d waiters with a %d tick timeout on a mutex held %d ticks\n", Waiters, Timeout, Hold);
+    VMPrint("%d acquired, %d timed out, longest wait %u ticks\n", Acquired, TimedOut, LongestWait);
+}
+
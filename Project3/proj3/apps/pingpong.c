@@ -0,0 +1,56 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_ITERATIONS      100000
+
+// Two threads of equal priority yield to each other with an immediate
+// sleep, so every iteration is one context switch. Build vm with
+// CONTEXT_REGISTERS=TRUE to compare against setjmp/longjmp switching.
+volatile int Finished = 0;
+int Iterations = DEFAULT_ITERATIONS;
+struct timespec StartTime;
+int Started = 0;
+
+void VMThreadPingPong(void *param){
+    if(!Started){
+        Started = 1;
+        clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    }
+    for(int Index = 0; Index < Iterations; Index++){
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+    }
+    Finished++;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    struct timespec EndTime;
+    long long ElapsedNS, Switches;
+
+    if(1 < argc){
+        Iterations = atoi(argv[1]);
+        if(0 >= Iterations){
+            Iterations = DEFAULT_ITERATIONS;
+        }
+    }
+    for(int Index = 0; Index < 2; Index++){
+        VMThreadCreate(VMThreadPingPong, NULL, 0x10000, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    while(Finished < 2){
+        VMThreadSleep(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    ElapsedNS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000000LL + (EndTime.tv_nsec - StartTime.tv_nsec);
+    if(0 >= ElapsedNS){
+        ElapsedNS = 1;
+    }
+    Switches = 2LL * Iterations;
+    VMPrint("%lld switches in %lld us, %lld ns per switch, %lld switches/sec\n", Switches, ElapsedNS / 1000, ElapsedNS / Switches, Switches * 1000000000LL / ElapsedNS);
+}
+
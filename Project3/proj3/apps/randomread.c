@@ -0,0 +1,93 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_READS           2000
+#define DEFAULT_BLOCKS          256
+#define BLOCK_SIZE              512
+
+// Reads random blocks of a file, once with VMFileSeek followed by
+// VMFileRead and once with VMFileReadAt, and reports the latency of each.
+// Every block is filled with its own index so reads can be checked.
+char Block[BLOCK_SIZE];
+unsigned int RandomState = 12345;
+
+unsigned int NextRandom(void){
+    RandomState = RandomState * 1103515245 + 12345;
+    return RandomState >> 16;
+}
+
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+int CheckBlock(int index){
+    for(int Offset = 0; Offset < BLOCK_SIZE; Offset++){
+        if(Block[Offset] != (char)index){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void VMMain(int argc, char *argv[]){
+    int FileDescriptor, Length, Reads = DEFAULT_READS, Blocks = DEFAULT_BLOCKS, Index;
+    struct timespec StartTime, EndTime;
+    long long SeekNS, PositionalNS;
+
+    if(1 < argc){
+        Reads = atoi(argv[1]);
+        if(0 >= Reads){
+            Reads = DEFAULT_READS;
+        }
+    }
+    if(2 < argc){
+        Blocks = atoi(argv[2]);
+        if(0 >= Blocks){
+            Blocks = DEFAULT_BLOCKS;
+        }
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("randomread.txt", O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptor)){
+        VMPrint("Failed to open randomread.txt\n");
+        return;
+    }
+    for(Index = 0; Index < Blocks; Index++){
+        memset(Block, (char)Index, BLOCK_SIZE);
+        Length = BLOCK_SIZE;
+        VMFileWriteAt(FileDescriptor, Block, &Length, (TVMFileOffset)Index * BLOCK_SIZE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Read = 0; Read < Reads; Read++){
+        Index = NextRandom() % Blocks;
+        Length = BLOCK_SIZE;
+        VMFileSeek(FileDescriptor, Index * BLOCK_SIZE, SEEK_SET, NULL);
+        if((VM_STATUS_SUCCESS != VMFileRead(FileDescriptor, Block, &Length))||(BLOCK_SIZE != Length)||!CheckBlock(Index)){
+            VMPrint("Seek and read of block %d failed\n", Index);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    SeekNS = ElapsedNS(&StartTime, &EndTime);
+
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Read = 0; Read < Reads; Read++){
+        Index = NextRandom() % Blocks;
+        Length = BLOCK_SIZE;
+        if((VM_STATUS_SUCCESS != VMFileReadAt(FileDescriptor, Block, &Length, (TVMFileOffset)Index * BLOCK_SIZE))||(BLOCK_SIZE != Length)||!CheckBlock(Index)){
+            VMPrint("Positional read of block %d failed\n", Index);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    PositionalNS = ElapsedNS(&StartTime, &EndTime);
+    VMFileClose(FileDescriptor);
+
+    VMPrint("%d random reads of %d byte blocks\n", Reads, BLOCK_SIZE);
+    VMPrint("VMFileSeek + VMFileRead %lld ns per read\n", SeekNS / Reads);
+    VMPrint("VMFileReadAt            %lld ns per read\n", PositionalNS / Reads);
+}
+
@@ -0,0 +1,78 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_ROUNDS          16
+#define BLOCK_SIZE              512
+#define ROUND_BLOCKS            8
+
+// Run with VM_MACHINE_READAHEAD set to turn the read-ahead window on. The
+// file is opened twice, one descriptor reads it sequentially so the server
+// prefetches past the read, the other overwrites the range the next read
+// returns. Every read after a write has to see the new data.
+char Block[BLOCK_SIZE];
+
+int CheckBlock(char value){
+    for(int Offset = 0; Offset < BLOCK_SIZE; Offset++){
+        if(Block[Offset] != value){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void VMMain(int argc, char *argv[]){
+    int Reader, Writer, Length, Offset, Rounds = DEFAULT_ROUNDS, Stale = 0;
+
+    if(1 < argc){
+        Rounds = atoi(argv[1]);
+        if(0 >= Rounds){
+            Rounds = DEFAULT_ROUNDS;
+        }
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("readahead.txt", O_CREAT | O_TRUNC | O_RDWR, 0644, &Writer)){
+        VMPrint("Failed to open readahead.txt\n");
+        return;
+    }
+    memset(Block, 'a', BLOCK_SIZE);
+    for(int Index = 0; Index < Rounds * ROUND_BLOCKS; Index++){
+        Length = BLOCK_SIZE;
+        VMFileWrite(Writer, Block, &Length);
+    }
+    if(VM_STATUS_SUCCESS != VMFileOpen("readahead.txt", O_RDONLY, 0644, &Reader)){
+        VMPrint("Failed to reopen readahead.txt\n");
+        VMFileClose(Writer);
+        return;
+    }
+    for(int Round = 0; Round < Rounds; Round++){
+        // Enough sequential reads for the server to prefetch the rest
+        for(int Index = 0; Index < ROUND_BLOCKS / 2; Index++){
+            Length = BLOCK_SIZE;
+            VMFileRead(Reader, Block, &Length);
+        }
+        Offset = (Round * ROUND_BLOCKS + ROUND_BLOCKS / 2) * BLOCK_SIZE;
+        memset(Block, 'Z', BLOCK_SIZE);
+        Length = BLOCK_SIZE;
+        if(Round & 1){
+            VMFileSeek(Writer, Offset, SEEK_SET, &Offset);
+            VMFileWrite(Writer, Block, &Length);
+        }
+        else{
+            VMFileWriteAt(Writer, Block, &Length, Offset);
+        }
+        Length = BLOCK_SIZE;
+        VMFileRead(Reader, Block, &Length);
+        if((BLOCK_SIZE != Length) || !CheckBlock('Z')){
+            Stale++;
+        }
+        for(int Index = ROUND_BLOCKS / 2 + 1; Index < ROUND_BLOCKS; Index++){
+            Length = BLOCK_SIZE;
+            VMFileRead(Reader, Block, &Length);
+        }
+    }
+    VMFileClose(Reader);
+    VMFileClose(Writer);
+    VMPrint("%d rounds, %d stale reads after a write\n", Rounds, Stale);
+}
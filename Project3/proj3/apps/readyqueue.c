@@ -0,0 +1,82 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_THREADS         2000
+#define DEFAULT_YIELDS          20
+
+// Fills the ready queues with thousands of threads spread over every
+// priority below MAX and has each of them yield a number of times, so the
+// scheduler always picks from a long ready list. The switch cost should
+// stay close to pingpong, which only ever has two threads ready.
+volatile int Finished = 0;
+int Threads = DEFAULT_THREADS;
+int Yields = DEFAULT_YIELDS;
+long long ActivateNS;
+struct timespec StartTime, EndTime;
+
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMThreadYielder(void *param){
+    for(int Index = 0; Index < Yields; Index++){
+        VMThreadSleep(VM_TIMEOUT_IMMEDIATE);
+    }
+    // The last one stops the clock, main only notices on its next tick
+    if(++Finished == Threads){
+        clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    }
+}
+
+// Runs above every worker so none of them starts until all are ready
+void VMThreadSpawner(void *param){
+    TVMThreadID ThreadID;
+
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < Threads; Index++){
+        TVMThreadPriority Priority = VM_THREAD_PRIORITY_LOW + Index % (VM_THREAD_PRIORITY_MAX - VM_THREAD_PRIORITY_LOW);
+
+        if(VM_STATUS_SUCCESS != VMThreadCreate(VMThreadYielder, NULL, 0x2000, Priority, &ThreadID)){
+            VMPrint("Failed to create thread %d\n", Index);
+            Threads = Index;
+            break;
+        }
+        VMThreadActivate(ThreadID);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    ActivateNS = ElapsedNS(&StartTime, &EndTime);
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    long long SwitchNS;
+
+    if(1 < argc){
+        Threads = atoi(argv[1]);
+        if(0 >= Threads){
+            Threads = DEFAULT_THREADS;
+        }
+    }
+    if(2 < argc){
+        Yields = atoi(argv[2]);
+        if(0 >= Yields){
+            Yields = DEFAULT_YIELDS;
+        }
+    }
+    VMThreadCreate(VMThreadSpawner, NULL, 0x10000, VM_THREAD_PRIORITY_MAX, &ThreadID);
+    VMThreadActivate(ThreadID);
+    while(Finished < Threads){
+        VMThreadSleep(1);
+    }
+    SwitchNS = ElapsedNS(&StartTime, &EndTime);
+    VMPrint("%d threads over %d priorities, %d yields each\n", Threads, VM_THREAD_PRIORITY_MAX - VM_THREAD_PRIORITY_LOW, Yields);
+    VMPrint("Create and activate %lld ns per thread\n", ActivateNS / (Threads ? Threads : 1));
+    VMPrint("Yield %lld ns per switch\n", SwitchNS / ((long long)(Threads ? Threads : 1) * Yields));
+}
+
@@ -0,0 +1,120 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_ROUNDS          10
+#define WATCH_NS                200000000LL
+
+// Run with vm -c 2 or more. Main keeps its processor busy without calling
+// into the VM while it changes what another processor should be running:
+// it terminates a spinner running there, and it activates a NORMAL thread
+// while a LOW spinner runs there. Either way the other processor has to
+// reschedule now, otherwise nothing changes until its next tick.
+volatile int Spinning;
+volatile int Started;
+struct timespec LastSpin, StartTime;
+
+long long ElapsedNS(struct timespec *start, struct timespec *end){
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+void VMThreadSpinner(void *param){
+    while(1){
+        Spinning = 1;
+        clock_gettime(CLOCK_MONOTONIC, &LastSpin);
+    }
+}
+
+void VMThreadStarter(void *param){
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    Started = 1;
+}
+
+void Watch(struct timespec *start, volatile int *flag){
+    struct timespec Now;
+
+    do{
+        clock_gettime(CLOCK_MONOTONIC, &Now);
+    }while(!*flag && (ElapsedNS(start, &Now) < WATCH_NS));
+}
+
+// Seeing the flag set again while main never leaves its processor means the
+// spinner is running on another one, returns false if it never is
+int StartSpinner(TVMThreadPriority prio, TVMThreadIDRef tid){
+    struct timespec Now;
+
+    Spinning = 0;
+    VMThreadCreate(VMThreadSpinner, NULL, 0x10000, prio, tid);
+    VMThreadActivate(*tid);
+    while(!Spinning){
+        VMThreadSleep(1);
+    }
+    Spinning = 0;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    Watch(&Now, &Spinning);
+    if(!Spinning){
+        VMThreadTerminate(*tid);
+        VMPrint("Spinner never ran beside main, run with vm -c 2 or more\n");
+        return 0;
+    }
+    return 1;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID, SpinnerID;
+    struct timespec ActionTime;
+    long long Delay, TerminateWorst = 0, TerminateTotal = 0, ActivateWorst = 0, ActivateTotal = 0;
+    int Rounds = DEFAULT_ROUNDS;
+
+    if(1 < argc){
+        Rounds = atoi(argv[1]);
+        if(0 >= Rounds){
+            Rounds = DEFAULT_ROUNDS;
+        }
+    }
+    for(int Round = 0; Round < Rounds; Round++){
+        if(!StartSpinner(VM_THREAD_PRIORITY_NORMAL, &ThreadID)){
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ActionTime);
+        VMThreadTerminate(ThreadID);
+        Started = 0;
+        Watch(&ActionTime, &Started);
+        Delay = ElapsedNS(&ActionTime, &LastSpin);
+        if(0 > Delay){
+            Delay = 0;
+        }
+        TerminateTotal += Delay;
+        if(Delay > TerminateWorst){
+            TerminateWorst = Delay;
+        }
+    }
+    for(int Round = 0; Round < Rounds; Round++){
+        if(!StartSpinner(VM_THREAD_PRIORITY_LOW, &SpinnerID)){
+            return;
+        }
+        Started = 0;
+        clock_gettime(CLOCK_MONOTONIC, &ActionTime);
+        StartTime = ActionTime;
+        VMThreadCreate(VMThreadStarter, NULL, 0x10000, VM_THREAD_PRIORITY_NORMAL, &ThreadID);
+        VMThreadActivate(ThreadID);
+        Watch(&ActionTime, &Started);
+        // Main sleeps so the spinner can be stopped wherever it ended up
+        while(!Started){
+            VMThreadSleep(1);
+        }
+        VMThreadTerminate(SpinnerID);
+        Delay = ElapsedNS(&ActionTime, &StartTime);
+        ActivateTotal += Delay;
+        if(Delay > ActivateWorst){
+            ActivateWorst = Delay;
+        }
+    }
+    VMPrint("%d rounds\n", Rounds);
+    VMPrint("Terminated spinner kept running %lld us on average, %lld us at worst\n", TerminateTotal / Rounds / 1000, TerminateWorst / 1000);
+    VMPrint("Activated thread waited %lld us on average, %lld us at worst\n", ActivateTotal / Rounds / 1000, ActivateWorst / 1000);
+}
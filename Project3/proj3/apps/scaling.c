@@ -0,0 +1,70 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_THREADS         4
+#define DEFAULT_WORK            50000000
+#define MAX_THREADS             64
+
+// Runs CPU bound threads that each spin through the same amount of work and
+// reports the wall time, compare vm -c 1 against vm -c N to see how well
+// threads spread over the virtual processors. Finished threads are counted
+// under a mutex.
+TVMMutexID FinishedMutex;
+int Finished = 0;
+int Threads = DEFAULT_THREADS;
+long long Work = DEFAULT_WORK;
+volatile unsigned int Results[MAX_THREADS];
+
+void VMThreadWork(void *param){
+    unsigned int Value = (unsigned int)(long)param;
+
+    for(long long Index = 0; Index < Work; Index++){
+        Value = Value * 1103515245 + 12345;
+    }
+    Results[(long)param] = Value;
+    VMMutexAcquire(FinishedMutex, VM_TIMEOUT_INFINITE);
+    Finished++;
+    VMMutexRelease(FinishedMutex);
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    struct timespec StartTime, EndTime;
+    long long ElapsedNS;
+    int Done = 0;
+
+    if(1 < argc){
+        Threads = atoi(argv[1]);
+        if((0 >= Threads)||(MAX_THREADS < Threads)){
+            Threads = DEFAULT_THREADS;
+        }
+    }
+    if(2 < argc){
+        Work = atoll(argv[2]);
+        if(0 >= Work){
+            Work = DEFAULT_WORK;
+        }
+    }
+    VMMutexCreate(&FinishedMutex);
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(long Index = 0; Index < Threads; Index++){
+        VMThreadCreate(VMThreadWork, (void *)Index, 0x10000, VM_THREAD_PRIORITY_NORMAL, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    while(Done < Threads){
+        VMThreadSleep(1);
+        VMMutexAcquire(FinishedMutex, VM_TIMEOUT_INFINITE);
+        Done = Finished;
+        VMMutexRelease(FinishedMutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    ElapsedNS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000000LL + (EndTime.tv_nsec - StartTime.tv_nsec);
+    VMPrint("%d threads of %lld iterations\n", Threads, Work);
+    VMPrint("Elapsed %lld ms, %lld ns per iteration\n", ElapsedNS / 1000000, ElapsedNS / (Work * Threads));
+}
+
@@ -0,0 +1,67 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+
+#ifndef NULL
+#define NULL    ((void *)0)
+#endif
+
+#define DEFAULT_SLEEPERS        2000
+#define DEFAULT_TICKS           200
+#define MAX_SLEEP_TICKS         64
+
+// Keeps thousands of threads sleeping for random short periods while the
+// main thread counts how much work it gets done per tick. Run it with 0
+// sleepers for the baseline, the difference is what the tick handler and
+// the wakeups cost.
+volatile int Running = 1;
+int Sleepers = DEFAULT_SLEEPERS;
+int Ticks = DEFAULT_TICKS;
+long long Wakeups = 0;
+
+void VMThreadSleeper(void *param){
+    unsigned int RandomState = (unsigned int)(long)param * 2654435761U + 1;
+
+    while(Running){
+        RandomState = RandomState * 1103515245 + 12345;
+        VMThreadSleep(1 + (RandomState >> 16) % MAX_SLEEP_TICKS);
+        Wakeups++;
+    }
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    TVMTick Start, Now;
+    volatile long long Work = 0;
+
+    if(1 < argc){
+        Sleepers = atoi(argv[1]);
+        if(0 > Sleepers){
+            Sleepers = DEFAULT_SLEEPERS;
+        }
+    }
+    if(2 < argc){
+        Ticks = atoi(argv[2]);
+        if(0 >= Ticks){
+            Ticks = DEFAULT_TICKS;
+        }
+    }
+    for(long Index = 0; Index < Sleepers; Index++){
+        if(VM_STATUS_SUCCESS != VMThreadCreate(VMThreadSleeper, (void *)Index, 0x2000, VM_THREAD_PRIORITY_HIGH, &ThreadID)){
+            VMPrint("Failed to create thread %ld\n", Index);
+            Sleepers = Index;
+            break;
+        }
+        VMThreadActivate(ThreadID);
+    }
+    VMTickCount(&Start);
+    do{
+        for(int Index = 0; Index < 1000; Index++){
+            Work++;
+        }
+        VMTickCount(&Now);
+    }while(Now - Start < (TVMTick)Ticks);
+    Running = 0;
+    VMPrint("%d sleepers, %lld wakeups in %d ticks\n", Sleepers, Wakeups, Ticks);
+    VMPrint("Main thread work %lld per tick\n", Work / Ticks);
+}
+
@@ -0,0 +1,38 @@
+#include "VirtualMachine.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS      10000
+#define THREAD_STACK_SIZE       0x4000
+
+// Creates, activates and runs a trivial high priority thread to completion
+// over and over to measure the cost of thread start up.
+volatile int Completed = 0;
+
+void VMThreadEmpty(void *param){
+    Completed++;
+}
+
+void VMMain(int argc, char *argv[]){
+    TVMThreadID ThreadID;
+    int Iterations = DEFAULT_ITERATIONS;
+    struct timespec StartTime, EndTime;
+    long long ElapsedNS;
+
+    if(1 < argc){
+        Iterations = atoi(argv[1]);
+        if(0 >= Iterations){
+            Iterations = DEFAULT_ITERATIONS;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    for(int Index = 0; Index < Iterations; Index++){
+        // Higher priority so the thread runs and terminates inside Activate
+        VMThreadCreate(VMThreadEmpty, NULL, THREAD_STACK_SIZE, VM_THREAD_PRIORITY_HIGH, &ThreadID);
+        VMThreadActivate(ThreadID);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    ElapsedNS = (EndTime.tv_sec - StartTime.tv_sec) * 1000000000LL + (EndTime.tv_nsec - StartTime.tv_nsec);
+    VMPrint("%d of %d threads ran in %lld us, %lld ns per create+activate+terminate\n", Completed, Iterations, ElapsedNS / 1000, ElapsedNS / Iterations);
+}
+
@@ -0,0 +1,64 @@
+#include "VirtualMachine.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_FILES           8
+#define MAX_FILES               64
+#define DATA_SIZE               0x10000
+#define HEADER_SIZE             4
+
+// Run with vm -w. Leaves a few bytes buffered on several descriptors, and
+// on stdout when it is redirected to a file, so their write-behind buffers
+// hold most or all of the shared memory, then reads more than the whole
+// shared region back from one of them. The read has to make do with what
+// is free or reclaim the buffers instead of waiting for memory nobody
+// releases.
+char Data[HEADER_SIZE + DATA_SIZE];
+char Check[HEADER_SIZE + DATA_SIZE];
+
+void VMMain(int argc, char *argv[]){
+    int FileDescriptors[MAX_FILES];
+    int Files = DEFAULT_FILES, Length, Offset;
+    char FileName[32];
+
+    if(1 < argc){
+        Files = atoi(argv[1]);
+        if((0 >= Files)||(MAX_FILES < Files)){
+            Files = DEFAULT_FILES;
+        }
+    }
+    for(int Index = 0; Index < HEADER_SIZE + DATA_SIZE; Index++){
+        Data[Index] = (char)(Index * 7);
+    }
+    for(int Index = 0; Index < Files; Index++){
+        snprintf(FileName, sizeof(FileName), "writebehind%d.txt", Index);
+        if(VM_STATUS_SUCCESS != VMFileOpen(FileName, O_CREAT | O_TRUNC | O_RDWR, 0644, &FileDescriptors[Index])){
+            VMPrint("Failed to open %s\n", FileName);
+            return;
+        }
+    }
+    // The bulk of the first file goes straight through, the header after
+    // it is small enough to be buffered
+    Length = DATA_SIZE;
+    VMFileWriteAt(FileDescriptors[0], Data + HEADER_SIZE, &Length, HEADER_SIZE);
+    for(int Index = 0; Index < Files; Index++){
+        VMFileSeek(FileDescriptors[Index], 0, 0, &Offset);
+        Length = HEADER_SIZE;
+        VMFileWrite(FileDescriptors[Index], Data, &Length);
+    }
+    VMPrint("%d descriptors with buffered data, reading %d bytes back\n", Files, HEADER_SIZE + DATA_SIZE);
+    VMFileSeek(FileDescriptors[0], 0, 0, &Offset);
+    Length = HEADER_SIZE + DATA_SIZE;
+    if((VM_STATUS_SUCCESS != VMFileRead(FileDescriptors[0], Check, &Length)) || (HEADER_SIZE + DATA_SIZE != Length) || memcmp(Data, Check, Length)){
+        VMPrint("Read back FAILED, %d bytes\n", Length);
+    }
+    else{
+        VMPrint("Read back OK\n");
+    }
+    for(int Index = 0; Index < Files; Index++){
+        VMFileClose(FileDescriptors[Index]);
+    }
+}
+
@@ -10,14 +10,20 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include <vector>
-#include <map>
+#include <deque>
+#include <unordered_map>
 
 extern "C"{
 
@@ -32,24 +38,167 @@ extern "C"{
 #define MACHINE_REQUEST_SEEK            5
 #define MACHINE_REQUEST_CLOSE           6
 #define MACHINE_REQUEST_TERMINATE       7
+#define MACHINE_REQUEST_READV           8
+#define MACHINE_REQUEST_WRITEV          9
+#define MACHINE_REQUEST_READAT          10
+#define MACHINE_REQUEST_WRITEAT         11
 
 #define MACHINE_MAX_MESSAGE_SIZE        0x10000
 #define MACHINE_PAGE_SIZE               4096
-#define MACHINE_MAX_TRANSFER_SIZE       512
+#define MACHINE_HUGE_PAGE_SIZE          0x200000
+
+#define MACHINE_TRANSPORT_RING          0
+#define MACHINE_TRANSPORT_MSGQ          1
+
+#define MACHINE_REQUEST_RING_SLOTS      64
+#define MACHINE_REPLY_RING_SLOTS        256
+#define MACHINE_RING_PAYLOAD_SIZE       (4096 + 64)
+#define MACHINE_CACHE_LINE_SIZE         64
+#define MACHINE_MAX_EVENTS              64
+
+// New contexts are booted by switching stacks directly where the inline 
+// assembly below exists, otherwise through the SIGUSR1/sigaltstack path
+#if !defined(MACHINE_CONTEXT_SIGNAL_BOOT) && (defined(__x86_64__) || defined(__aarch64__))
+#define MACHINE_CONTEXT_FAST_BOOT
+#endif
+#if defined(MACHINE_CONTEXT_REGISTERS) && !defined(__x86_64__) && !defined(__aarch64__)
+#error MACHINE_CONTEXT_REGISTERS is only available on x86-64 and aarch64
+#endif
+
+#define MACHINE_DEFAULT_PENDING_SLOTS   256
+#define MACHINE_MAX_PENDING_SLOTS       0x10000
+#define MACHINE_PENDING_SLOT_MASK       0xFFFF
+#define MACHINE_PENDING_GENERATION_MASK 0x7FFF
+#define MACHINE_PENDING_NO_SLOT         0x80000000
+
+// Sequential reads of regular files are served from a window the server 
+// prefetches after MACHINE_READAHEAD_TRIGGER reads in a row. It is off 
+// unless VM_MACHINE_READAHEAD gives the window size.
+#define MACHINE_READAHEAD_SLOTS         16
+#define MACHINE_READAHEAD_TRIGGER       2
+
+// Latency histograms are kept per request type and phase when 
+// VM_MACHINE_HISTOGRAMS is set to text or json. Buckets are log-linear, each
+// power of two is split into MACHINE_HISTOGRAM_SUB_BUCKETS linear steps.
+#define MACHINE_HISTOGRAM_OPEN          0
+#define MACHINE_HISTOGRAM_READ          1
+#define MACHINE_HISTOGRAM_WRITE         2
+#define MACHINE_HISTOGRAM_SEEK          3
+#define MACHINE_HISTOGRAM_CLOSE         4
+#define MACHINE_HISTOGRAM_TYPES         5
+#define MACHINE_HISTOGRAM_QUEUE         0
+#define MACHINE_HISTOGRAM_SERVICE       1
+#define MACHINE_HISTOGRAM_DELIVERY      2
+#define MACHINE_HISTOGRAM_TOTAL         3
+#define MACHINE_HISTOGRAM_PHASES        4
+#define MACHINE_HISTOGRAM_SUB_BITS      3
+#define MACHINE_HISTOGRAM_SUB_BUCKETS   (1 << MACHINE_HISTOGRAM_SUB_BITS)
+#define MACHINE_HISTOGRAM_BUCKETS       ((64 - MACHINE_HISTOGRAM_SUB_BITS + 1) * MACHINE_HISTOGRAM_SUB_BUCKETS)
+#define MACHINE_HISTOGRAM_FORMAT_TEXT   1
+#define MACHINE_HISTOGRAM_FORMAT_JSON   2
+
+#define MACHINE_TRACE_DEFAULT_EVENTS    0x10000
+#define MACHINE_TRACE_MAX_EVENTS        0x1000000
+
+#define MACHINE_DEFERRED_REPLY          0x01
+#define MACHINE_DEFERRED_ALARM          0x02
+#define MACHINE_DEFERRED_KICK           0x04
+
+#define MACHINE_MAX_PROCESSORS          64
+#define MACHINE_LOCK_SPINS              100
+// Real-time so a kick is never merged with a pending alarm
+#define MACHINE_KICK_SIGNAL             SIGRTMIN
+
+// Single-producer/single-consumer ring living in the shared mapping. The 
+// producer owns DHead, the consumer owns DTail, each on its own cache line. 
+// DSleeping is set by the consumer before it blocks so the producer only 
+// rings the doorbell when it has to.
+typedef struct{
+    long DType;
+    uint32_t DRequestID;
+    uint32_t DLength;
+    uint8_t DPayload[MACHINE_RING_PAYLOAD_SIZE];
+} SMachineRequestEntry, *SMachineRequestEntryRef;
+
+typedef struct{
+    uint32_t DRequestID;
+    int DResult;
+} SMachineReplyEntry, *SMachineReplyEntryRef;
+
+typedef struct{
+    volatile uint32_t DHead;
+    uint8_t DPadHead[MACHINE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+    volatile uint32_t DTail;
+    volatile uint32_t DSleeping;
+    uint8_t DPadTail[MACHINE_CACHE_LINE_SIZE - sizeof(uint32_t) * 2];
+    SMachineRequestEntry DEntries[MACHINE_REQUEST_RING_SLOTS];
+} SMachineRequestRing, *SMachineRequestRingRef;
+
+typedef struct{
+    volatile uint32_t DHead;
+    uint8_t DPadHead[MACHINE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+    volatile uint32_t DTail;
+    volatile uint32_t DSignalPending;
+    volatile uint32_t DPollCount;
+    volatile uint32_t DPollQuietUS;
+    uint8_t DPadTail[MACHINE_CACHE_LINE_SIZE - sizeof(uint32_t) * 4];
+    SMachineReplyEntry DEntries[MACHINE_REPLY_RING_SLOTS];
+} SMachineReplyRing, *SMachineReplyRingRef;
+
+typedef struct{
+    SMachineRequestRing DRequests;
+    SMachineReplyRing DReplies;
+} SMachineRings, *SMachineRingsRef;
+
+// One read-ahead window per slot, descriptors share slots by fd modulo 
+// MACHINE_READAHEAD_SLOTS. Each side counts the requests it has seen for a
+// slot, the server stamps a window with its count and the VM only consumes 
+// it while its own count still matches, so the server owns the window again
+// as soon as any later request for the slot is sent. Opens and writes on 
+// any descriptor advance the epoch, which retires every window, since the 
+// descriptor written may be another one open on the same file.
+typedef struct{
+    volatile uint32_t DStamp;
+    uint32_t DEpoch;
+    int DFileDescriptor;
+    int64_t DOffset;
+    int DLength;
+    int DConsumed;
+} SMachineReadAheadSlot, *SMachineReadAheadSlotRef;
+
+// Server side view of a descriptor's reads, DNext is -1 for anything that 
+// is not a regular file
+typedef struct{
+    int64_t DNext;
+    int DStreak;
+} SMachineReadAheadStream, *SMachineReadAheadStreamRef;
 
 typedef struct{
     pid_t DParentPID;
     pid_t DChildPID;
+    int DTransport;
     int DRequestChannel;
     int DReplyChannel;
-    int DMMapFile;
+    uint8_t *DMapBase;
+    size_t DMapSize;
+    SMachineRingsRef DRings;
     uint8_t *DSharedBase;
     size_t DSharedSize;
+    uint8_t *DReadAheadBase;
+    size_t DReadAheadSize;
+    int DReadAheadWindow;
 } SMachineData, *SMachineDataRef;
 
+// Pending callbacks live in a slab mapped at initialization for every slot
+// an ID can name. A request ID is the slot index in the low 16 bits and the
+// slot generation above it, so a stale or duplicate reply never matches a 
+// reused slot. 
 typedef struct{
     TMachineFileCallback DCallback;
     void *DCalldata;
+    uint32_t DGeneration;
+    uint32_t DNextFree;
+    bool DInUse;
 } SMachinePendingCallback, *SMachinePendingCallbackRef;
 
 typedef struct{
@@ -58,15 +207,44 @@ typedef struct{
     uint8_t DPayload[1];
 } SMachineRequest, *SMachineRequestRef;
 
+// Vectored reads fill DVectors instead of DBuffer
 typedef struct{
     uint32_t DRequestID;
     int DFileDescriptor;
     int DLength;
     uint8_t *DBuffer;
+    std::vector< struct iovec > DVectors;
 } SMachinePendingRead, *SMachinePendingReadRef;
 
+typedef std::unordered_map< int, std::deque< SMachinePendingRead > > TMachinePendingReadMap;
+
+// Only the VM records into histograms, updates are atomic so a dump from
+// the signal handler never sees a torn counter
+typedef struct{
+    uint64_t DCount;
+    uint64_t DSum;
+    uint64_t DMax;
+    uint64_t DBuckets[MACHINE_HISTOGRAM_BUCKETS];
+} SMachineHistogram, *SMachineHistogramRef;
+
+// Dump output is built up here, the signal handler can't use stdio
+typedef struct{
+    char DData[256];
+    size_t DLength;
+} SMachineHistogramOutput, *SMachineHistogramOutputRef;
+
+// Server side timestamps of the request in a pending slot, kept in a 
+// shared mapping indexed like the pending callback slab
+typedef struct{
+    uint64_t DDequeue;
+    uint64_t DComplete;
+} SMachineRequestTiming, *SMachineRequestTimingRef;
+
 static bool MachineInitialized = false;
 static SMachineData MachineData;
+static uint32_t MachineReadAheadCount[MACHINE_READAHEAD_SLOTS];
+static uint32_t MachineReadAheadEpoch = 0;
+static std::unordered_map< int, SMachineReadAheadStream > MachineReadAheadStreams;
 static SMachineContext MachineContextCaller;
 static sig_atomic_t MachineContextCalled;
 static SMachineContextRef MachineContextCreateRef;
@@ -75,16 +253,255 @@ static void *MachineContextCreateParam;
 static sigset_t MachineContextCreateSignals;
 //static volatile sig_atomic_t MachinePendingRequest = false;
 static int MachineSignalPipe[2];
+static int MachineParentPipe[2];
+static std::vector< SMachineReplyEntry > MachineReplyOverflow;
 static TMachineAlarmCallback MachineAlarmCallback = NULL;
 static void *MachineAlarmCalldata = NULL;
+static timer_t MachineAlarmTimer;
+static bool MachineAlarmTimerCreated = false;
 struct sigaction MachineAlarmActionSave;
-static volatile uint32_t MachineRequestID = 0;
-static std::map< uint32_t , SMachinePendingCallback > MachinePendingCallbacks;
+static SMachinePendingCallbackRef MachinePendingSlots = NULL;
+static size_t MachinePendingSlotsSize = 0;
+static uint32_t MachinePendingCapacity = 0;
+static uint32_t MachinePendingFreeHead = 0;
+static volatile unsigned int MachinePendingExhausted = 0;
+static volatile int MachineBatchDepth = 0;
+static volatile bool MachineBatchDoorbell = false;
+static bool MachineReplyNotifyPending = false;
+static bool MachineReplyPollDeferred = false;
+static uint32_t MachineReplyPollSeen;
+static uint64_t MachineReplyPollDeadline;
+// Critical sections only set MachineSignalsDeferred, a handler that lands 
+// inside one records its work in MachineDeferredWork for the exit to replay.
+// Both belong to the host thread, so each processor replays its own work.
+static __thread volatile sig_atomic_t MachineSignalsDeferred = 0;
+static __thread volatile int MachineDeferredWork = 0;
+// With more than one processor the critical section is also MachineLock,
+// which is held from entry to exit even across context switches
+static int MachineProcessorCount = 1;
+static __thread int MachineProcessorIndex = 0;
+static TMachineSpinLock MachineLock = 0;
+static __thread volatile int MachineLockHeld = 0;
+static pthread_t MachineProcessorThreads[MACHINE_MAX_PROCESSORS];
+static pid_t MachineProcessorTIDs[MACHINE_MAX_PROCESSORS];
+static timer_t MachineProcessorTimers[MACHINE_MAX_PROCESSORS];
+static TMachineProcessorEntry MachineProcessorEntry;
+static sigset_t MachineProcessorSignals;
+static volatile int MachineProcessorsStarted = 0;
+static volatile int MachineProcessorsParked = 0;
+static volatile int MachineProcessorStopper = -1;
+static TMachineAlarmCallback MachineKickCallback = NULL;
+static void *MachineKickCalldata = NULL;
+static struct sigaction MachineKickActionSave;
+SMachineStatistics MachineStatisticsData;
+static int MachineHistogramFormat = 0;
+static SMachineHistogram MachineHistograms[MACHINE_HISTOGRAM_TYPES][MACHINE_HISTOGRAM_PHASES];
+static SMachineRequestTimingRef MachineRequestTimings = NULL;
+static size_t MachineRequestTimingsSize = 0;
+static uint64_t *MachineRequestSubmitted = NULL;
+static uint8_t *MachineRequestTypes = NULL;
+static struct sigaction MachineHistogramActionSave;
+// Trace ring, recording happens with signals suspended in the VM so the
+// index needs no atomics
+static SMachineTraceEventRef MachineTraceEvents = NULL;
+static uint64_t MachineTraceRecorded = 0;
+static uint32_t MachineTraceMask = 0;
+static char MachineTracePath[PATH_MAX];
 
 void MachineContextCreateTrampoline(int sig);
 void MachineContextCreateBoot(void);
+void MachineContextCreateSignal(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize);
+void MachineContextCreateFast(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize);
+void MachinePrintStatistics(void);
+void MachineReplyDrain(void);
+void MachineReplyDrainQueue(void);
+void *MachineMapRegion(size_t *size, int visibility, int hugepages);
+void MachineBlockSignals(sigset_t *oldset);
+void MachineDeferWork(int work);
+bool MachineSignalEnter(int work);
+void MachineLockAcquire(void);
+void MachineSignalLeave(void);
+#ifdef MACHINE_URING
+void *MachineUringInitialize(size_t sharesize, size_t requestcapacity, int hugepages);
+void MachineUringTerminate(void);
+void MachineUringReplyDrain(void);
+void MachineUringEnablePolling(useconds_t quietus);
+void MachineUringPollReplies(void);
+unsigned int MachineUringExhaustedCount(void);
+void MachineUringSubmitBatch(void);
+void MachineUringFlush(void);
+#endif
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in the old context and pops the new context's registers off its
+// stack. The return address saved by the call is the resume point. The
+// floating point control state is callee-saved too, so every context keeps
+// its own rounding mode and exception masks.
+#if defined(__x86_64__)
+__asm__(".text\n"
+        ".globl MachineContextSwitchRegisters\n"
+        ".type MachineContextSwitchRegisters, @function\n"
+        "MachineContextSwitchRegisters:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size MachineContextSwitchRegisters, .-MachineContextSwitchRegisters\n"
+        // First switch into a new context returns here with entry in r12
+        // and param in r13, and the stack 16 byte aligned
+        ".type MachineContextRegistersStart, @function\n"
+        "MachineContextRegistersStart:\n"
+        "    movq %r13, %rdi\n"
+        "    call *%r12\n"
+        "    ud2\n"
+        ".size MachineContextRegistersStart, .-MachineContextRegistersStart\n");
+#elif defined(__aarch64__)
+__asm__(".text\n"
+        ".globl MachineContextSwitchRegisters\n"
+        ".type MachineContextSwitchRegisters, %function\n"
+        "MachineContextSwitchRegisters:\n"
+        "    stp x19, x20, [sp, #-176]!\n"
+        "    stp x21, x22, [sp, #16]\n"
+        "    stp x23, x24, [sp, #32]\n"
+        "    stp x25, x26, [sp, #48]\n"
+        "    stp x27, x28, [sp, #64]\n"
+        "    stp x29, x30, [sp, #80]\n"
+        "    stp d8, d9, [sp, #96]\n"
+        "    stp d10, d11, [sp, #112]\n"
+        "    stp d12, d13, [sp, #128]\n"
+        "    stp d14, d15, [sp, #144]\n"
+        "    mrs x2, fpcr\n"
+        "    str x2, [sp, #160]\n"
+        "    mov x2, sp\n"
+        "    str x2, [x0]\n"
+        "    ldr x2, [x1]\n"
+        "    mov sp, x2\n"
+        "    ldr x2, [sp, #160]\n"
+        "    msr fpcr, x2\n"
+        "    ldp d14, d15, [sp, #144]\n"
+        "    ldp d12, d13, [sp, #128]\n"
+        "    ldp d10, d11, [sp, #112]\n"
+        "    ldp d8, d9, [sp, #96]\n"
+        "    ldp x29, x30, [sp, #80]\n"
+        "    ldp x27, x28, [sp, #64]\n"
+        "    ldp x25, x26, [sp, #48]\n"
+        "    ldp x23, x24, [sp, #32]\n"
+        "    ldp x21, x22, [sp, #16]\n"
+        "    ldp x19, x20, [sp], #176\n"
+        "    ret\n"
+        ".size MachineContextSwitchRegisters, .-MachineContextSwitchRegisters\n"
+        // First switch into a new context returns here with entry in x19
+        // and param in x20
+        ".type MachineContextRegistersStart, %function\n"
+        "MachineContextRegistersStart:\n"
+        "    mov x0, x20\n"
+        "    blr x19\n"
+        "    brk #0\n"
+        ".size MachineContextRegistersStart, .-MachineContextRegistersStart\n");
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+void MachineContextRegistersStart(void);
+
+void MachineContextCreateRegisters(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    uintptr_t StackTop = ((uintptr_t)stackaddr + stacksize) & ~(uintptr_t)0xF;
+    uintptr_t *Frame;
+    
+    // Lay out the frame MachineContextSwitchRegisters expects to pop, a
+    // new context starts with the ABI's default floating point control
+#if defined(__x86_64__)
+    Frame = (uintptr_t *)(StackTop - 80);
+    memset(Frame, 0, 80);
+    Frame[0] = 0x1F80 | ((uintptr_t)0x037F << 32);      // mxcsr, x87 cw
+    Frame[3] = (uintptr_t)param;                        // r13
+    Frame[4] = (uintptr_t)entry;                        // r12
+    Frame[7] = (uintptr_t)MachineContextRegistersStart; // return address
+#else
+    Frame = (uintptr_t *)(StackTop - 176);
+    memset(Frame, 0, 176);
+    Frame[0] = (uintptr_t)entry;                        // x19
+    Frame[1] = (uintptr_t)param;                        // x20
+    Frame[11] = (uintptr_t)MachineContextRegistersStart;// x30
+#endif
+    mcntxref->DStackPointer = Frame;
+}
+#endif
 
 void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+#if defined(MACHINE_CONTEXT_REGISTERS)
+    MachineContextCreateRegisters(mcntxref, entry, param, stackaddr, stacksize);
+#elif defined(MACHINE_CONTEXT_FAST_BOOT)
+    MachineContextCreateFast(mcntxref, entry, param, stackaddr, stacksize);
+#else
+    MachineContextCreateSignal(mcntxref, entry, param, stackaddr, stacksize);
+#endif
+}
+
+#ifdef MACHINE_CONTEXT_FAST_BOOT
+void MachineContextFastBoot(void){
+    void (* volatile MachineContextStartFunction)(void *);
+    void * volatile MachineContextStartParam;
+    
+    // Globals are copied to the new stack before the next create reuses them
+    MachineContextStartFunction = MachineContextCreateFunction;
+    MachineContextStartParam = MachineContextCreateParam;
+    
+    // Save this frame as the context and go back to the creator 
+    MachineContextSwitch(MachineContextCreateRef, &MachineContextCaller);
+    
+    // The thread "magically" starts... 
+    MachineContextStartFunction(MachineContextStartParam);
+    
+    // NOTREACHED 
+    abort();
+}
+
+void MachineContextCreateFast(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
+    // Top of the stack, aligned to 16 bytes as both ABIs require at a call
+    uintptr_t StackTop = ((uintptr_t)stackaddr + stacksize) & ~(uintptr_t)0xF;
+    
+    MachineContextCreateRef = mcntxref;
+    MachineContextCreateFunction = entry;
+    MachineContextCreateParam = param;
+    
+    // No syscalls: move to the new stack and call the boot function, which 
+    // jumps straight back here once it has saved its context
+    if(MachineContextSave(&MachineContextCaller) == 0){
+#if defined(__x86_64__)
+        __asm__ volatile("mov %0, %%rsp\n\t"
+                         "xor %%ebp, %%ebp\n\t"
+                         "call *%1\n\t"
+                         "ud2"
+                         : : "r"(StackTop), "r"(MachineContextFastBoot) : "memory");
+#elif defined(__aarch64__)
+        __asm__ volatile("mov sp, %0\n\t"
+                         "mov x29, xzr\n\t"
+                         "blr %1\n\t"
+                         "brk #0"
+                         : : "r"(StackTop), "r"(MachineContextFastBoot) : "memory", "x29", "x30");
+#endif
+    }
+}
+#endif
+
+void MachineContextCreateSignal(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize){
     struct sigaction SigAction;
     struct sigaction OldSigAction;
     stack_t SigStack;
@@ -181,6 +598,15 @@ int MachineGetInt(uint8_t *ptr){
     return Value;
 }
 
+int64_t MachineGetLong(uint8_t *ptr){
+    int64_t Value = 0;
+    for(size_t Index = 0; Index < sizeof(int64_t); Index++){
+        Value <<= 8;
+        Value |= ptr[Index];
+    }
+    return Value;
+}
+
 uint8_t *MachineGetPointer(uint8_t *ptr){
     uint8_t *Value = (uint8_t *)0;
     uint8_t *Dest = (uint8_t *)&Value;
@@ -196,6 +622,12 @@ void MachineSetInt(uint8_t *ptr, int val){
     }
 }
 
+void MachineSetLong(uint8_t *ptr, int64_t val){
+    for(size_t Index = 0; Index < sizeof(int64_t); Index++){
+        ptr[Index] = (val>>((sizeof(int64_t) - Index - 1) * 8));
+    }
+}
+
 void MachineSetPointer(uint8_t *ptr, uint8_t *val){
     uint8_t *Source = (uint8_t *)&val;
     for(size_t Index = 0; Index < sizeof(uint8_t *); Index++){
@@ -213,178 +645,1408 @@ bool MachineValidSharePointer(uint8_t *ptr){
     return true;
 }
 
-void MachineRequestSignalHandler(int signum){
-    uint8_t TempByte = 0;
-    write(MachineSignalPipe[1],&TempByte, 1);
+bool MachineValidShareRange(uint8_t *ptr, int length){
+    if((0 > length) || !MachineValidSharePointer(ptr)){
+        return false;
+    }
+    return (size_t)length <= (size_t)(MachineData.DSharedBase + MachineData.DSharedSize - ptr);
 }
 
-void MachineReplySignalHandler(int signum){
-    uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-    SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-    ssize_t MessageSize;
+int MachineWriteAll(int fd, uint8_t *buffer, int length){
+    int Written = 0;
+    int Result;
+    
+    // Large transfers are completed here so the caller gets one reply
+    while(Written < length){
+        Result = write(fd, buffer + Written, length - Written);
+        if(0 > Result){
+            if(EINTR == errno){
+                continue;
+            }
+            return Written ? Written : -1;
+        }
+        if(0 == Result){
+            break;
+        }
+        Written += Result;
+    }
+    return Written;
+}
 
-    do{
-        MessageSize = msgrcv(MachineData.DReplyChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-        if(0 < MessageSize){
-            if(MachinePendingCallbacks.end() != MachinePendingCallbacks.find(MessageRef->DRequestID)){
-                SMachinePendingCallback Callinfo = MachinePendingCallbacks[MessageRef->DRequestID];
-                int ReturnValue = MachineGetInt(MessageRef->DPayload);
-                MachinePendingCallbacks.erase(MessageRef->DRequestID);
-                Callinfo.DCallback(Callinfo.DCalldata, ReturnValue);
+int MachineWriteAllAt(int fd, uint8_t *buffer, int length, int64_t offset){
+    int Written = 0;
+    int Result;
+    
+    while(Written < length){
+        Result = pwrite(fd, buffer + Written, length - Written, offset + Written);
+        if(0 > Result){
+            if(EINTR == errno){
+                continue;
             }
-            else{
-                fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",MessageRef->DRequestID);
+            return Written ? Written : -1;
+        }
+        if(0 == Result){
+            break;
+        }
+        Written += Result;
+    }
+    return Written;
+}
+
+// Skips the first bytes of a vector after a partial transfer, returns the 
+// index of the first segment with data left
+int MachineIOVectorAdvance(struct iovec *vector, int count, size_t bytes){
+    int Index = 0;
+    
+    while((Index < count) && (bytes >= vector[Index].iov_len)){
+        bytes -= vector[Index].iov_len;
+        Index++;
+    }
+    if(Index < count){
+        vector[Index].iov_base = (uint8_t *)vector[Index].iov_base + bytes;
+        vector[Index].iov_len -= bytes;
+    }
+    return Index;
+}
+
+int MachineWriteAllV(int fd, struct iovec *vector, int count){
+    int Written = 0;
+    int Index = 0;
+    int Result;
+    
+    while(Index < count){
+        Result = writev(fd, vector + Index, count - Index);
+        if(0 > Result){
+            if(EINTR == errno){
+                continue;
             }
+            return Written ? Written : -1;
         }
-    }while(0 < MessageSize);
+        if(0 == Result){
+            break;
+        }
+        Written += Result;
+        Index += MachineIOVectorAdvance(vector + Index, count - Index, Result);
+    }
+    return Written;
+}
+
+// Vectored payloads are the descriptor, the segment count and then a 
+// pointer and length per segment
+int MachineSetIOVector(uint8_t *payload, int fd, SMachineIOVectorRef vector, int count){
+    uint8_t *Segment = payload + sizeof(int) * 2;
     
+    if(MACHINE_MAX_IO_VECTORS < count){
+        count = MACHINE_MAX_IO_VECTORS;
+    }
+    MachineSetInt(payload, fd);
+    MachineSetInt(payload + sizeof(int), count);
+    for(int Index = 0; Index < count; Index++){
+        MachineSetPointer(Segment, (uint8_t *)vector[Index].DBase);
+        MachineSetInt(Segment + sizeof(uint8_t *), vector[Index].DLength);
+        Segment += sizeof(uint8_t *) + sizeof(int);
+    }
+    return Segment - payload;
+}
+
+bool MachineGetIOVector(uint8_t *payload, std::vector< struct iovec > &vector){
+    uint8_t *Segment = payload + sizeof(int) * 2;
+    int Count = MachineGetInt(payload + sizeof(int));
+    size_t Total = 0;
+    struct iovec Entry;
     
+    vector.clear();
+    if((0 >= Count) || (MACHINE_MAX_IO_VECTORS < Count)){
+        return false;
+    }
+    for(int Index = 0; Index < Count; Index++){
+        uint8_t *Base = MachineGetPointer(Segment);
+        int Length = MachineGetInt(Segment + sizeof(uint8_t *));
+        
+        // The total has to fit the int result in the reply
+        Total += Length;
+        if(!MachineValidShareRange(Base, Length) || (INT_MAX < Total)){
+            return false;
+        }
+        Entry.iov_base = Base;
+        Entry.iov_len = Length;
+        vector.push_back(Entry);
+        Segment += sizeof(uint8_t *) + sizeof(int);
+    }
+    return true;
 }
 
-uint32_t MachineAddRequest(TMachineFileCallback callback, void *calldata){
-    SMachinePendingCallback Callback;
+void MachineRequestSignalHandler(int signum){
+    uint8_t TempByte = 0;
+    write(MachineSignalPipe[1],&TempByte, 1);
+}
+
+void MachineRingDoorbell(void){
+    uint8_t TempByte = 0;
+    MachineStatisticsData.DRequestSignals++;
+    write(MachineSignalPipe[1],&TempByte, 1);
+}
+
+void MachineWakeServer(void){
+    if(MachineBatchDepth){
+        MachineBatchDoorbell = true;
+    }
+    else if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+        MachineStatisticsData.DRequestSignals++;
+        kill(MachineData.DChildPID, SIGUSR2);
+    }
+    else{
+        MachineRingDoorbell();
+    }
+}
+
+void MachineRequestRingPush(SMachineRequestRef mess, int length){
+    SMachineRequestRingRef Ring = &MachineData.DRings->DRequests;
+    uint32_t Head = Ring->DHead;
+    SMachineRequestEntryRef Entry;
     
-    Callback.DCallback = callback;
-    Callback.DCalldata = calldata;
+    // Server is a separate process, so it drains the ring even while the 
+    // caller has signals suspended
+    while(MACHINE_REQUEST_RING_SLOTS <= (Head - __atomic_load_n(&Ring->DTail, __ATOMIC_ACQUIRE))){
+        MachineRingDoorbell();
+        sched_yield();
+    }
+    if(MACHINE_RING_PAYLOAD_SIZE < length){
+        length = MACHINE_RING_PAYLOAD_SIZE;
+    }
+    Entry = &Ring->DEntries[Head % MACHINE_REQUEST_RING_SLOTS];
+    Entry->DType = mess->DType;
+    Entry->DRequestID = mess->DRequestID;
+    Entry->DLength = length;
+    memcpy(Entry->DPayload, mess->DPayload, length);
+    __atomic_store_n(&Ring->DHead, Head + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&Ring->DSleeping, __ATOMIC_RELAXED)){
+        MachineWakeServer();
+    }
+}
+
+bool MachineRequestRingReady(void){
+    SMachineRequestRingRef Ring = &MachineData.DRings->DRequests;
     
-    MachineRequestID++;
-    MachinePendingCallbacks[(uint32_t)MachineRequestID] = Callback;
-    return MachineRequestID;
+    return Ring->DTail != __atomic_load_n(&Ring->DHead, __ATOMIC_ACQUIRE);
 }
 
-void MachineSendReply(SMachineRequestRef mess, int length){
-    msgsnd(MachineData.DReplyChannel, mess, length, 0);
-    kill(MachineData.DParentPID, SIGUSR2);
+bool MachineRequestRingPop(SMachineRequestRef mess){
+    SMachineRequestRingRef Ring = &MachineData.DRings->DRequests;
+    uint32_t Tail = Ring->DTail;
+    SMachineRequestEntryRef Entry;
+    
+    if(Tail == __atomic_load_n(&Ring->DHead, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+    Entry = &Ring->DEntries[Tail % MACHINE_REQUEST_RING_SLOTS];
+    mess->DType = Entry->DType;
+    mess->DRequestID = Entry->DRequestID;
+    memcpy(mess->DPayload, Entry->DPayload, Entry->DLength);
+    __atomic_store_n(&Ring->DTail, Tail + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
-void *MachineInitialize(size_t sharesize){
-    TMachineSignalState SigStateSave;
-    struct sigaction OldSigAction, SigAction;
-    uint8_t TempPage[MACHINE_PAGE_SIZE];
-    int PageCount = ((sizeof(TempPage) - 1) + sharesize)/sizeof(TempPage);
+bool MachineReplyRingPush(uint32_t requestid, int result){
+    SMachineReplyRingRef Ring = &MachineData.DRings->DReplies;
+    uint32_t Head = Ring->DHead;
+    SMachineReplyEntryRef Entry;
     
-    if(MachineInitialized){
+    if(MACHINE_REPLY_RING_SLOTS <= (Head - __atomic_load_n(&Ring->DTail, __ATOMIC_ACQUIRE))){
+        return false;
+    }
+    Entry = &Ring->DEntries[Head % MACHINE_REPLY_RING_SLOTS];
+    Entry->DRequestID = requestid;
+    Entry->DResult = result;
+    __atomic_store_n(&Ring->DHead, Head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool MachineReplyRingPop(SMachineReplyEntryRef reply){
+    SMachineReplyRingRef Ring = &MachineData.DRings->DReplies;
+    uint32_t Tail = Ring->DTail;
+    
+    if(Tail == __atomic_load_n(&Ring->DHead, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+    *reply = Ring->DEntries[Tail % MACHINE_REPLY_RING_SLOTS];
+    __atomic_store_n(&Ring->DTail, Tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint64_t MachineMonotonicNS(void){
+    struct timespec Now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint64_t)Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+}
+
+// Returns 0 when histograms are off so callers can skip the stamps
+uint64_t MachineHistogramClock(void){
+    return MachineHistogramFormat ? MachineMonotonicNS() : 0;
+}
+
+int MachineHistogramBucket(uint64_t value){
+    int Exponent;
+    
+    if(MACHINE_HISTOGRAM_SUB_BUCKETS > value){
+        return value;
+    }
+    Exponent = 63 - __builtin_clzll(value);
+    return (Exponent - MACHINE_HISTOGRAM_SUB_BITS + 1) * MACHINE_HISTOGRAM_SUB_BUCKETS + ((value >> (Exponent - MACHINE_HISTOGRAM_SUB_BITS)) & (MACHINE_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t MachineHistogramBucketStart(int bucket){
+    int Exponent;
+    
+    if(MACHINE_HISTOGRAM_SUB_BUCKETS > bucket){
+        return bucket;
+    }
+    Exponent = bucket / MACHINE_HISTOGRAM_SUB_BUCKETS + MACHINE_HISTOGRAM_SUB_BITS - 1;
+    return (uint64_t)(MACHINE_HISTOGRAM_SUB_BUCKETS + bucket % MACHINE_HISTOGRAM_SUB_BUCKETS) << (Exponent - MACHINE_HISTOGRAM_SUB_BITS);
+}
+
+void MachineHistogramRecord(int type, int phase, uint64_t nanoseconds){
+    SMachineHistogramRef Histogram;
+    
+    if((0 > type) || (MACHINE_HISTOGRAM_TYPES <= type)){
+        return;
+    }
+    Histogram = &MachineHistograms[type][phase];
+    __atomic_fetch_add(&Histogram->DCount, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&Histogram->DSum, nanoseconds, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&Histogram->DBuckets[MachineHistogramBucket(nanoseconds)], 1, __ATOMIC_RELAXED);
+    if(nanoseconds > __atomic_load_n(&Histogram->DMax, __ATOMIC_RELAXED)){
+        __atomic_store_n(&Histogram->DMax, nanoseconds, __ATOMIC_RELAXED);
+    }
+}
+
+int MachineHistogramType(long requesttype){
+    switch(requesttype){
+        case MACHINE_REQUEST_OPEN:      return MACHINE_HISTOGRAM_OPEN;
+        case MACHINE_REQUEST_READ:
+        case MACHINE_REQUEST_READV:
+        case MACHINE_REQUEST_READAT:    return MACHINE_HISTOGRAM_READ;
+        case MACHINE_REQUEST_WRITE:
+        case MACHINE_REQUEST_WRITEV:
+        case MACHINE_REQUEST_WRITEAT:   return MACHINE_HISTOGRAM_WRITE;
+        case MACHINE_REQUEST_SEEK:      return MACHINE_HISTOGRAM_SEEK;
+        case MACHINE_REQUEST_CLOSE:     return MACHINE_HISTOGRAM_CLOSE;
+        default:                        return -1;
+    }
+}
+
+SMachineRequestTimingRef MachineRequestTiming(uint32_t requestid){
+    uint32_t Slot = requestid & MACHINE_PENDING_SLOT_MASK;
+    
+    if(!MachineRequestTimings || (requestid & MACHINE_PENDING_NO_SLOT) || (MachineRequestTimingsSize <= Slot)){
         return NULL;
     }
+    return MachineRequestTimings + Slot;
+}
+
+// VM side, called as a request is sent and just before its callback
+void MachineHistogramSubmit(SMachineRequestRef mess){
+    SMachineRequestTimingRef Timing = MachineRequestTiming(mess->DRequestID);
+    uint32_t Slot = mess->DRequestID & MACHINE_PENDING_SLOT_MASK;
     
-    sigaction(SIGALRM, NULL, &MachineAlarmActionSave);
-    MachineData.DParentPID = getpid();
-    MachineData.DRequestChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DRequestChannel){
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
-        exit(1);
+    if(Timing){
+        Timing->DDequeue = 0;
+        Timing->DComplete = 0;
+        MachineRequestTypes[Slot] = MachineHistogramType(mess->DType) + 1;
+        MachineRequestSubmitted[Slot] = MachineMonotonicNS();
     }
-    MachineData.DReplyChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0666);
-    if(0 > MachineData.DReplyChannel){
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
-        exit(1);
+}
+
+void MachineHistogramReply(uint32_t requestid){
+    SMachineRequestTimingRef Timing = MachineRequestTiming(requestid);
+    uint32_t Slot = requestid & MACHINE_PENDING_SLOT_MASK;
+    uint64_t Now;
+    int Type;
+    
+    if(!Timing || !MachineRequestTypes[Slot]){
+        return;
     }
-    MachineData.DMMapFile = open("./vm_shmem", O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
-    if(0 > MachineData.DMMapFile){
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to create shared memory file: %s\n", strerror(errno));
-        exit(1);
+    Now = MachineMonotonicNS();
+    Type = MachineRequestTypes[Slot] - 1;
+    MachineRequestTypes[Slot] = 0;
+    if(Timing->DDequeue && Timing->DComplete){
+        MachineHistogramRecord(Type, MACHINE_HISTOGRAM_QUEUE, Timing->DDequeue - MachineRequestSubmitted[Slot]);
+        MachineHistogramRecord(Type, MACHINE_HISTOGRAM_SERVICE, Timing->DComplete - Timing->DDequeue);
+        MachineHistogramRecord(Type, MACHINE_HISTOGRAM_DELIVERY, Now - Timing->DComplete);
     }
-    memset(TempPage,0,sizeof(TempPage));
-    for(int Index = 0; Index < PageCount; Index++){
-        write(MachineData.DMMapFile,TempPage,sizeof(TempPage));   
+    MachineHistogramRecord(Type, MACHINE_HISTOGRAM_TOTAL, Now - MachineRequestSubmitted[Slot]);
+}
+
+// Server side, the stamps are published by the reply that follows them
+void MachineHistogramDequeue(uint32_t requestid){
+    SMachineRequestTimingRef Timing = MachineRequestTiming(requestid);
+    
+    if(Timing){
+        Timing->DDequeue = MachineMonotonicNS();
     }
-    MachineData.DSharedSize = sizeof(TempPage) * PageCount;
-    MachineData.DSharedBase = (uint8_t *)mmap(NULL, MachineData.DSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, MachineData.DMMapFile, 0);
-    if(MAP_FAILED == MachineData.DSharedBase){
-        close(MachineData.DMMapFile);
-        unlink("./vm_shmem");
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        fprintf(stderr,"Failed to map shared memory file: %s\n", strerror(errno));
-        exit(1);
+}
+
+void MachineHistogramComplete(uint32_t requestid){
+    SMachineRequestTimingRef Timing = MachineRequestTiming(requestid);
+    
+    if(Timing){
+        Timing->DComplete = MachineMonotonicNS();
+    }
+}
+
+// Dumps are formatted by hand and written straight to stderr, so they only
+// use async-signal-safe calls and can run from the signal handler
+void MachineHistogramFlush(SMachineHistogramOutputRef output){
+    if(output->DLength){
+        write(STDERR_FILENO, output->DData, output->DLength);
+        output->DLength = 0;
     }
+}
+
+// Appends text padded with spaces to at least width characters
+void MachineHistogramText(SMachineHistogramOutputRef output, const char *text, int width){
+    while(*text || (0 < width)){
+        if(sizeof(output->DData) == output->DLength){
+            MachineHistogramFlush(output);
+        }
+        output->DData[output->DLength++] = *text ? *text++ : ' ';
+        width--;
+    }
+}
+
+void MachineHistogramNumber(SMachineHistogramOutputRef output, uint64_t value){
+    char Digits[21];
+    int Index = sizeof(Digits) - 1;
     
+    Digits[Index] = '\0';
+    do{
+        Digits[--Index] = '0' + value % 10;
+        value /= 10;
+    }while(value);
+    MachineHistogramText(output, Digits + Index, 0);
+}
+
+uint64_t MachineHistogramPercentile(SMachineHistogramRef histogram, uint64_t count, int percent){
+    uint64_t Target = (count * percent + 99) / 100;
+    uint64_t Max = __atomic_load_n(&histogram->DMax, __ATOMIC_RELAXED);
+    uint64_t Seen = 0;
+    uint64_t End;
     
-    MachineSuspendSignals(&SigStateSave);
+    for(int Bucket = 0; Bucket + 1 < MACHINE_HISTOGRAM_BUCKETS; Bucket++){
+        Seen += __atomic_load_n(&histogram->DBuckets[Bucket], __ATOMIC_RELAXED);
+        if(Seen >= Target){
+            // Report the end of the bucket so the value is an upper bound
+            End = MachineHistogramBucketStart(Bucket + 1) - 1;
+            return End < Max ? End : Max;
+        }
+    }
+    return Max;
+}
+
+void MachineHistogramDump(void){
+    static const char *TypeNames[MACHINE_HISTOGRAM_TYPES] = {"open", "read", "write", "seek", "close"};
+    static const char *PhaseNames[MACHINE_HISTOGRAM_PHASES] = {"queue", "service", "delivery", "total"};
+    SMachineHistogramOutput Output;
+    bool FirstType = true;
     
-    MachineData.DChildPID = fork();
-    if(0 == MachineData.DChildPID){
-        bool Terminated = false;
-        std::vector< struct pollfd > PollFDs;
-        std::vector< SMachinePendingRead > PendingReads;
-        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
-        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
-        ssize_t MessageSize;
-        sigset_t SigMask;
-        int Result, FileDescriptor, Length, Flags, Mode;
-        int Offset, Whence;
-        uint8_t *BufferPointer;
+    Output.DLength = 0;
+    if(MACHINE_HISTOGRAM_FORMAT_TEXT == MachineHistogramFormat){
+        MachineHistogramText(&Output, "Machine request latency (ns)\n", 0);
+    }
+    else{
+        MachineHistogramText(&Output, "{", 0);
+    }
+    for(int Type = 0; Type < MACHINE_HISTOGRAM_TYPES; Type++){
+        bool FirstPhase = true;
         
-        MachineData.DChildPID = getpid();
-        pipe(MachineSignalPipe);
-        PollFDs.resize(1);
-        PollFDs[0].fd = MachineSignalPipe[0];
-        PollFDs[0].events = POLLIN;
-        PollFDs[0].revents = 0;
-        memset((void *)&SigAction, 0, sizeof(struct sigaction));
-        SigAction.sa_handler = MachineRequestSignalHandler;
-        sigemptyset(&SigAction.sa_mask);
-        sigaction(SIGUSR2, &SigAction, &OldSigAction);
-        MachineEnableSignals();
-        while(!Terminated){
-            sigemptyset(&SigMask);
-            PollFDs[0].events = POLLIN;
-            PollFDs[0].revents = 0;
-            Result = poll(PollFDs.data(), PollFDs.size(), 1);
-            if((0 < Result)&&(PollFDs[0].revents)){
-                SMachinePendingRead PendingRead;
-                bool Found;
-                uint8_t TempByte;
-
-                read(PollFDs[0].fd, &TempByte, 1);
-                while(true){
-                    MessageSize = msgrcv(MachineData.DRequestChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
-                    if(0 < MessageSize){
-                        switch(MessageRef->DType){
-                            case MACHINE_REQUEST_NONE:          break;
-                            case MACHINE_REQUEST_OPEN:          Flags = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + 1);
-                                                                Mode = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + sizeof(int) + 1);
-                                                                FileDescriptor = open((char *)MessageRef->DPayload, Flags, Mode);
-                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
-                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                                                                break;
+        if(0 == __atomic_load_n(&MachineHistograms[Type][MACHINE_HISTOGRAM_TOTAL].DCount, __ATOMIC_RELAXED)){
+            continue;
+        }
+        if(MACHINE_HISTOGRAM_FORMAT_JSON == MachineHistogramFormat){
+            MachineHistogramText(&Output, FirstType ? "\"" : ",\"", 0);
+            MachineHistogramText(&Output, TypeNames[Type], 0);
+            MachineHistogramText(&Output, "\":{", 0);
+            FirstType = false;
+        }
+        for(int Phase = 0; Phase < MACHINE_HISTOGRAM_PHASES; Phase++){
+            SMachineHistogramRef Histogram = &MachineHistograms[Type][Phase];
+            uint64_t Count = __atomic_load_n(&Histogram->DCount, __ATOMIC_RELAXED);
+            uint64_t Sum = __atomic_load_n(&Histogram->DSum, __ATOMIC_RELAXED);
+            uint64_t Max = __atomic_load_n(&Histogram->DMax, __ATOMIC_RELAXED);
+            bool FirstBucket = true;
+            
+            if(0 == Count){
+                continue;
+            }
+            if(MACHINE_HISTOGRAM_FORMAT_TEXT == MachineHistogramFormat){
+                MachineHistogramText(&Output, TypeNames[Type], 6);
+                MachineHistogramText(&Output, PhaseNames[Phase], 9);
+                MachineHistogramText(&Output, "count ", 0);
+                MachineHistogramNumber(&Output, Count);
+                MachineHistogramText(&Output, ", mean ", 0);
+                MachineHistogramNumber(&Output, Sum / Count);
+                MachineHistogramText(&Output, ", p50 ", 0);
+                MachineHistogramNumber(&Output, MachineHistogramPercentile(Histogram, Count, 50));
+                MachineHistogramText(&Output, ", p90 ", 0);
+                MachineHistogramNumber(&Output, MachineHistogramPercentile(Histogram, Count, 90));
+                MachineHistogramText(&Output, ", p99 ", 0);
+                MachineHistogramNumber(&Output, MachineHistogramPercentile(Histogram, Count, 99));
+                MachineHistogramText(&Output, ", max ", 0);
+                MachineHistogramNumber(&Output, Max);
+                MachineHistogramText(&Output, "\n", 0);
+                continue;
+            }
+            MachineHistogramText(&Output, FirstPhase ? "\"" : ",\"", 0);
+            MachineHistogramText(&Output, PhaseNames[Phase], 0);
+            MachineHistogramText(&Output, "\":{\"count\":", 0);
+            MachineHistogramNumber(&Output, Count);
+            MachineHistogramText(&Output, ",\"sum\":", 0);
+            MachineHistogramNumber(&Output, Sum);
+            MachineHistogramText(&Output, ",\"max\":", 0);
+            MachineHistogramNumber(&Output, Max);
+            MachineHistogramText(&Output, ",\"buckets\":[", 0);
+            FirstPhase = false;
+            // Only occupied buckets are listed, as [start, count] pairs
+            for(int Bucket = 0; Bucket < MACHINE_HISTOGRAM_BUCKETS; Bucket++){
+                uint64_t BucketCount = __atomic_load_n(&Histogram->DBuckets[Bucket], __ATOMIC_RELAXED);
+                
+                if(BucketCount){
+                    MachineHistogramText(&Output, FirstBucket ? "[" : ",[", 0);
+                    MachineHistogramNumber(&Output, MachineHistogramBucketStart(Bucket));
+                    MachineHistogramText(&Output, ",", 0);
+                    MachineHistogramNumber(&Output, BucketCount);
+                    MachineHistogramText(&Output, "]", 0);
+                    FirstBucket = false;
+                }
+            }
+            MachineHistogramText(&Output, "]}", 0);
+        }
+        if(MACHINE_HISTOGRAM_FORMAT_JSON == MachineHistogramFormat){
+            MachineHistogramText(&Output, "}", 0);
+        }
+    }
+    if(MACHINE_HISTOGRAM_FORMAT_JSON == MachineHistogramFormat){
+        MachineHistogramText(&Output, "}\n", 0);
+    }
+    MachineHistogramFlush(&Output);
+}
+
+void MachineHistogramSignalHandler(int signum){
+    MachineHistogramDump();
+}
+
+// Histograms are dumped at MachineTerminate and whenever SIGQUIT arrives
+void MachineHistogramInitialize(void){
+    const char *Format = getenv("VM_MACHINE_HISTOGRAMS");
+    struct sigaction SigAction;
+    
+    MachineHistogramFormat = 0;
+    if(!Format || !*Format || (0 == strcmp(Format, "0"))){
+        return;
+    }
+    MachineHistogramFormat = 0 == strcmp(Format, "json") ? MACHINE_HISTOGRAM_FORMAT_JSON : MACHINE_HISTOGRAM_FORMAT_TEXT;
+    memset(MachineHistograms, 0, sizeof(MachineHistograms));
+    memset((void *)&SigAction, 0, sizeof(struct sigaction));
+    SigAction.sa_handler = MachineHistogramSignalHandler;
+    sigemptyset(&SigAction.sa_mask);
+    SigAction.sa_flags = SA_RESTART;
+    sigaction(SIGQUIT, &SigAction, &MachineHistogramActionSave);
+}
+
+// The timing slab is shared with the server, so it is mapped before the fork
+void MachineHistogramMapTimings(size_t capacity){
+    void *Base;
+    
+    if(!MachineHistogramFormat){
+        return;
+    }
+    MachineRequestTimingsSize = capacity * sizeof(SMachineRequestTiming);
+    Base = MachineMapRegion(&MachineRequestTimingsSize, MAP_SHARED, false);
+    MachineRequestSubmitted = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+    MachineRequestTypes = (uint8_t *)calloc(capacity, sizeof(uint8_t));
+    if((MAP_FAILED == Base) || !MachineRequestSubmitted || !MachineRequestTypes){
+        fprintf(stderr,"Failed to allocate request timings, histograms disabled\n");
+        MachineHistogramFormat = 0;
+        MachineRequestTimingsSize = 0;
+        return;
+    }
+    MachineRequestTimings = (SMachineRequestTimingRef)Base;
+    MachineRequestTimingsSize = capacity;
+}
+
+void MachineHistogramTerminate(void){
+    if(!MachineHistogramFormat){
+        return;
+    }
+    sigaction(SIGQUIT, &MachineHistogramActionSave, NULL);
+    MachineHistogramDump();
+    if(MachineRequestTimings){
+        munmap(MachineRequestTimings, MachineRequestTimingsSize * sizeof(SMachineRequestTiming));
+        MachineRequestTimings = NULL;
+    }
+    free(MachineRequestSubmitted);
+    free(MachineRequestTypes);
+    MachineRequestSubmitted = NULL;
+    MachineRequestTypes = NULL;
+    MachineHistogramFormat = 0;
+}
+
+void MachineTrace(uint32_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2){
+    SMachineTraceEventRef Event;
+    
+    if(!MachineTraceEvents){
+        return;
+    }
+    Event = MachineTraceEvents + (MachineTraceRecorded & MachineTraceMask);
+    Event->DTimestamp = MachineMonotonicNS();
+    Event->DType = type;
+    Event->DArguments[0] = arg0;
+    Event->DArguments[1] = arg1;
+    Event->DArguments[2] = arg2;
+    MachineTraceRecorded++;
+}
+
+// Histogram types line up with the trace request classes
+uint32_t MachineTraceRequestClass(long requesttype){
+    int Type = MachineHistogramType(requesttype);
+    
+    return 0 > Type ? MACHINE_TRACE_REQUEST_OTHER : Type;
+}
+
+void MachineTraceInitialize(void){
+    const char *Path = getenv("VM_MACHINE_TRACE");
+    const char *Events = getenv("VM_MACHINE_TRACE_EVENTS");
+    uint32_t Capacity = MACHINE_TRACE_DEFAULT_EVENTS;
+    const char *Expansion;
+    long Requested;
+    
+    if(!Path || !*Path){
+        return;
+    }
+    if(Events){
+        Requested = atol(Events);
+        if(0 < Requested){
+            // Round up to a power of two so the index is a mask
+            Capacity = 1;
+            while((Capacity < Requested) && (Capacity < MACHINE_TRACE_MAX_EVENTS)){
+                Capacity <<= 1;
+            }
+        }
+    }
+    MachineTraceEvents = (SMachineTraceEventRef)calloc(Capacity, sizeof(SMachineTraceEvent));
+    if(!MachineTraceEvents){
+        fprintf(stderr,"Failed to allocate trace ring, tracing disabled\n");
+        return;
+    }
+    MachineTraceMask = Capacity - 1;
+    MachineTraceRecorded = 0;
+    // A %p in the name becomes the process ID, so concurrent VMs can trace
+    // without overwriting each other
+    Expansion = strstr(Path, "%p");
+    if(Expansion){
+        snprintf(MachineTracePath, sizeof(MachineTracePath), "%.*s%d%s", (int)(Expansion - Path), Path, (int)getpid(), Expansion + 2);
+    }
+    else{
+        snprintf(MachineTracePath, sizeof(MachineTracePath), "%s", Path);
+    }
+}
+
+void MachineTraceTerminate(void){
+    SMachineTraceHeader Header;
+    uint64_t First;
+    uint32_t Start;
+    int FileDescriptor;
+    
+    if(!MachineTraceEvents){
+        return;
+    }
+    memset(&Header, 0, sizeof(Header));
+    memcpy(Header.DMagic, MACHINE_TRACE_MAGIC, sizeof(MACHINE_TRACE_MAGIC));
+    Header.DVersion = MACHINE_TRACE_VERSION;
+    Header.DEventSize = sizeof(SMachineTraceEvent);
+    Header.DRecorded = MachineTraceRecorded;
+    Header.DCount = MachineTraceRecorded > MachineTraceMask ? (uint64_t)MachineTraceMask + 1 : MachineTraceRecorded;
+    First = MachineTraceRecorded - Header.DCount;
+    Start = First & MachineTraceMask;
+    FileDescriptor = open(MachineTracePath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(0 > FileDescriptor){
+        fprintf(stderr,"Failed to open trace file %s\n", MachineTracePath);
+    }
+    else{
+        // The oldest event is at Start once the ring has wrapped
+        MachineWriteAll(FileDescriptor, (uint8_t *)&Header, sizeof(Header));
+        MachineWriteAll(FileDescriptor, (uint8_t *)(MachineTraceEvents + Start), (Header.DCount - Start) * sizeof(SMachineTraceEvent));
+        MachineWriteAll(FileDescriptor, (uint8_t *)MachineTraceEvents, Start * sizeof(SMachineTraceEvent));
+        close(FileDescriptor);
+    }
+    free(MachineTraceEvents);
+    MachineTraceEvents = NULL;
+}
+
+void MachineReplyRingSignal(void){
+    MachineReplyPollDeferred = false;
+    // Only signal the parent if it has not been signaled since it last 
+    // started draining the ring
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(0 == __atomic_exchange_n(&MachineData.DRings->DReplies.DSignalPending, 1, __ATOMIC_SEQ_CST)){
+        kill(MachineData.DParentPID, SIGUSR2);
+    }
+}
+
+void MachineReplyRingNotify(void){
+    uint32_t QuietUS = __atomic_load_n(&MachineData.DRings->DReplies.DPollQuietUS, __ATOMIC_RELAXED);
+    
+    if(0 == QuietUS){
+        MachineReplyRingSignal();
+    }
+    else if(!MachineReplyPollDeferred){
+        // Give a polling parent one quiet period to find the replies itself
+        MachineReplyPollDeferred = true;
+        MachineReplyPollSeen = __atomic_load_n(&MachineData.DRings->DReplies.DPollCount, __ATOMIC_SEQ_CST);
+        MachineReplyPollDeadline = MachineMonotonicNS() + (uint64_t)QuietUS * 1000;
+    }
+}
+
+// Returns the epoll timeout in ms until deferred replies are due to be 
+// checked again, or -1 if nothing is deferred
+int MachineReplyPollCheck(void){
+    SMachineReplyRingRef Ring = &MachineData.DRings->DReplies;
+    uint64_t Now;
+    uint32_t Count;
+    
+    if(!MachineReplyPollDeferred){
+        return -1;
+    }
+    if(__atomic_load_n(&Ring->DTail, __ATOMIC_ACQUIRE) == Ring->DHead){
+        MachineReplyPollDeferred = false;
+        return -1;
+    }
+    Now = MachineMonotonicNS();
+    if(Now < MachineReplyPollDeadline){
+        return (MachineReplyPollDeadline - Now + 999999) / 1000000;
+    }
+    // Still polling means the replies came in after its last look
+    Count = __atomic_load_n(&Ring->DPollCount, __ATOMIC_SEQ_CST);
+    if(Count != MachineReplyPollSeen){
+        MachineReplyPollSeen = Count;
+        MachineReplyPollDeadline = Now + (uint64_t)Ring->DPollQuietUS * 1000;
+        return (Ring->DPollQuietUS + 999) / 1000;
+    }
+    MachineReplyRingSignal();
+    return -1;
+}
+
+void MachineServerNotify(void){
+    // Replies from one pass of the server loop share a single signal
+    if(MachineReplyNotifyPending){
+        MachineReplyNotifyPending = false;
+        if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+            kill(MachineData.DParentPID, SIGUSR2);
+        }
+        else{
+            MachineReplyRingNotify();
+        }
+    }
+}
+
+void MachineReplyRingFlush(void){
+    size_t Index = 0;
+    
+    while(Index < MachineReplyOverflow.size()){
+        if(!MachineReplyRingPush(MachineReplyOverflow[Index].DRequestID, MachineReplyOverflow[Index].DResult)){
+            break;
+        }
+        Index++;
+    }
+    if(Index){
+        MachineReplyOverflow.erase(MachineReplyOverflow.begin(), MachineReplyOverflow.begin() + Index);
+        MachineReplyRingNotify();
+    }
+}
+
+void MachinePendingInitialize(size_t capacity){
+    if((0 == capacity)||(MACHINE_MAX_PENDING_SLOTS < capacity)){
+        capacity = 0 == capacity ? MACHINE_DEFAULT_PENDING_SLOTS : MACHINE_MAX_PENDING_SLOTS;
+    }
+    // Pages past the capacity are only touched once it has to grow
+    MachinePendingSlotsSize = MACHINE_MAX_PENDING_SLOTS * sizeof(SMachinePendingCallback);
+    MachinePendingSlots = (SMachinePendingCallbackRef)mmap(NULL, MachinePendingSlotsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(MAP_FAILED == (void *)MachinePendingSlots){
+        fprintf(stderr,"Failed to map pending callbacks: %s\n", strerror(errno));
+        exit(1);
+    }
+    // The free list ends at a slot no ID can name, so growing the capacity
+    // never links the new slots into it by accident
+    MachinePendingCapacity = capacity;
+    for(uint32_t Index = 0; Index < MachinePendingCapacity; Index++){
+        MachinePendingSlots[Index].DNextFree = Index + 1 < MachinePendingCapacity ? Index + 1 : MACHINE_MAX_PENDING_SLOTS;
+    }
+    MachinePendingFreeHead = 0;
+    MachinePendingExhausted = 0;
+}
+
+void MachinePendingTerminate(void){
+    if(MachinePendingExhausted){
+        fprintf(stderr,"Machine pending callback slots exhausted %u times, capacity grew to %u\n", MachinePendingExhausted, MachinePendingCapacity);
+    }
+    munmap(MachinePendingSlots, MachinePendingSlotsSize);
+    MachinePendingSlots = NULL;
+    MachinePendingCapacity = 0;
+}
+
+unsigned int MachinePendingExhaustedCount(void){
+#ifdef MACHINE_URING
+    return MachineUringExhaustedCount();
+#else
+    return MachinePendingExhausted;
+#endif
+}
+
+void MachineDispatchReply(uint32_t requestid, int result){
+    uint32_t Slot = requestid & MACHINE_PENDING_SLOT_MASK;
+    SMachinePendingCallback Callinfo;
+    
+    if((Slot < MachinePendingCapacity)&&(MachinePendingSlots[Slot].DInUse)&&(MachinePendingSlots[Slot].DGeneration == (requestid >> 16))){
+        // Release the slot before the callback, which may never return
+        MachineHistogramReply(requestid);
+        Callinfo = MachinePendingSlots[Slot];
+        MachinePendingSlots[Slot].DInUse = false;
+        MachinePendingSlots[Slot].DNextFree = MachinePendingFreeHead;
+        MachinePendingFreeHead = Slot;
+        MachineStatisticsData.DReplies++;
+        MachineTrace(MACHINE_TRACE_REQUEST_COMPLETE, requestid, result, 0);
+        Callinfo.DCallback(Callinfo.DCalldata, result);
+        return;
+    }
+    fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",requestid);
+}
+
+void MachineReplySignalHandler(int signum){
+    MachineStatisticsData.DReplySignals++;
+    if(MachineSignalEnter(MACHINE_DEFERRED_REPLY)){
+        MachineLockAcquire();
+        MachineReplyDrain();
+        MachineSignalLeave();
+    }
+}
+
+void MachineReplyDrain(void){
+    if(MACHINE_TRANSPORT_RING == MachineData.DTransport){
+        SMachineReplyEntry Reply;
+        
+        __atomic_store_n(&MachineData.DRings->DReplies.DSignalPending, 0, __ATOMIC_SEQ_CST);
+        while(MachineReplyRingPop(&Reply)){
+            // The callback may switch away from a thread that will not run 
+            // again soon, so whoever leaves the critical section next has to
+            // pick up the replies behind this one
+            if(MachineData.DRings->DReplies.DTail != __atomic_load_n(&MachineData.DRings->DReplies.DHead, __ATOMIC_ACQUIRE)){
+                MachineDeferWork(MACHINE_DEFERRED_REPLY);
+            }
+            MachineDispatchReply(Reply.DRequestID, Reply.DResult);
+        }
+    }
+    else{
+        MachineReplyDrainQueue();
+    }
+}
+
+// Kept apart from MachineReplyDrain so the message buffer is only on the 
+// stack with the msgq transport, the handler runs on small guest stacks
+void MachineReplyDrainQueue(void){
+    uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+    SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+    ssize_t MessageSize;
+
+    do{
+        MessageSize = msgrcv(MachineData.DReplyChannel, MessageRef, sizeof(Buffer), 0, IPC_NOWAIT);
+        if(0 < MessageSize){
+            MachineDeferWork(MACHINE_DEFERRED_REPLY);
+            MachineDispatchReply(MessageRef->DRequestID, MachineGetInt(MessageRef->DPayload));
+        }
+    }while(0 < MessageSize);
+}
+
+uint32_t MachineAddRequest(TMachineFileCallback callback, void *calldata){
+    SMachinePendingCallbackRef Callback;
+    uint32_t Slot = MachinePendingFreeHead;
+    
+    MachineStatisticsData.DRequests++;
+    if(Slot < MachinePendingCapacity){
+        MachinePendingFreeHead = MachinePendingSlots[Slot].DNextFree;
+    }
+    else if(MachinePendingCapacity < MACHINE_MAX_PENDING_SLOTS){
+        // Every slot is in flight, the next untouched one is taken into use.
+        // Failing would deadlock threads whose requests wait on each other.
+        MachinePendingExhausted++;
+        Slot = MachinePendingCapacity++;
+    }
+    else{
+        // No ID is left, the request fails right away through its callback
+        // and MachineSendRequest drops it, which counts as its reply
+        MachineStatisticsData.DReplies++;
+        if(callback){
+            callback(calldata, -1);
+        }
+        return MACHINE_PENDING_NO_SLOT;
+    }
+    Callback = &MachinePendingSlots[Slot];
+    Callback->DCallback = callback;
+    Callback->DCalldata = calldata;
+    Callback->DGeneration = (Callback->DGeneration + 1) & MACHINE_PENDING_GENERATION_MASK;
+    Callback->DInUse = true;
+    return (Callback->DGeneration << 16) | Slot;
+}
+
+SMachineReadAheadSlotRef MachineReadAheadSlot(int index){
+    return (SMachineReadAheadSlotRef)MachineData.DReadAheadBase + index;
+}
+
+uint8_t *MachineReadAheadData(int index){
+    return MachineData.DReadAheadBase + MACHINE_PAGE_SIZE + (size_t)index * MachineData.DReadAheadWindow;
+}
+
+// Counts a request against its descriptor's slot and the epoch, returns 
+// the slot or -1 for requests that do not carry a descriptor. Both sides 
+// call this for every request in the same order.
+int MachineReadAheadCountRequest(SMachineRequestRef mess){
+    int FileDescriptor;
+    
+    if(!MachineData.DReadAheadWindow || (MACHINE_REQUEST_NONE == mess->DType) || (MACHINE_REQUEST_TERMINATE == mess->DType)){
+        return -1;
+    }
+    switch(mess->DType){
+        case MACHINE_REQUEST_OPEN:
+        case MACHINE_REQUEST_WRITE:
+        case MACHINE_REQUEST_WRITEV:
+        case MACHINE_REQUEST_WRITEAT:   MachineReadAheadEpoch++;
+                                        break;
+        default:                        break;
+    }
+    if(MACHINE_REQUEST_OPEN == mess->DType){
+        return -1;
+    }
+    FileDescriptor = MachineGetInt(mess->DPayload);
+    if(0 > FileDescriptor){
+        return -1;
+    }
+    MachineReadAheadCount[FileDescriptor % MACHINE_READAHEAD_SLOTS]++;
+    return FileDescriptor % MACHINE_READAHEAD_SLOTS;
+}
+
+// Answers a read from the window if it holds all of it
+bool MachineReadAheadHit(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    SMachineReadAheadSlotRef Slot;
+    int Index;
+    
+    if(!MachineData.DReadAheadWindow || (0 > fd) || (0 >= length)){
+        return false;
+    }
+    Index = fd % MACHINE_READAHEAD_SLOTS;
+    Slot = MachineReadAheadSlot(Index);
+    if((MachineReadAheadCount[Index] != __atomic_load_n(&Slot->DStamp, __ATOMIC_ACQUIRE)) || (MachineReadAheadEpoch != Slot->DEpoch) || (fd != Slot->DFileDescriptor) || (length > Slot->DLength - Slot->DConsumed)){
+        MachineStatisticsData.DReadAheadMisses++;
+        return false;
+    }
+    memcpy(data, MachineReadAheadData(Index) + Slot->DConsumed, length);
+    Slot->DConsumed += length;
+    MachineStatisticsData.DReadAheadHits++;
+    if(callback){
+        callback(calldata, length);
+    }
+    return true;
+}
+
+void MachineSendRequest(SMachineRequestRef mess, int length){
+    if(MACHINE_PENDING_NO_SLOT == mess->DRequestID){
+        return;
+    }
+    MachineReadAheadCountRequest(mess);
+    MachineHistogramSubmit(mess);
+    MachineTrace(MACHINE_TRACE_REQUEST_SUBMIT, mess->DRequestID, MachineTraceRequestClass(mess->DType), 0);
+    if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+        msgsnd(MachineData.DRequestChannel, mess, length, 0);
+        MachineWakeServer();
+    }
+    else{
+        MachineRequestRingPush(mess, length);
+    }
+}
+
+bool MachineReceiveRequest(SMachineRequestRef mess, size_t size){
+    if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+        return 0 < msgrcv(MachineData.DRequestChannel, mess, size, 0, IPC_NOWAIT);
+    }
+    return MachineRequestRingPop(mess);
+}
+
+void MachineSendReply(SMachineRequestRef mess, int length){
+    MachineHistogramComplete(mess->DRequestID);
+    if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+        msgsnd(MachineData.DReplyChannel, mess, length, 0);
+        MachineReplyNotifyPending = true;
+    }
+    else{
+        SMachineReplyEntry Reply;
+        
+        Reply.DRequestID = mess->DRequestID;
+        Reply.DResult = MachineGetInt(mess->DPayload);
+        if(!MachineReplyOverflow.empty() || !MachineReplyRingPush(Reply.DRequestID, Reply.DResult)){
+            MachineReplyOverflow.push_back(Reply);
+        }
+        MachineReplyNotifyPending = true;
+    }
+}
+
+void MachineServerReply(SMachineRequestRef mess, uint32_t requestid, int result){
+    mess->DRequestID = requestid;
+    MachineSetInt(mess->DPayload, result);
+    MachineSendReply(mess, sizeof(SMachineRequest) + sizeof(int) - 1);
+}
+
+void MachineServerRead(SMachinePendingReadRef pendingread, SMachineRequestRef mess){
+    int Result;
+    
+    do{
+        if(pendingread->DVectors.empty()){
+            Result = read(pendingread->DFileDescriptor, pendingread->DBuffer, pendingread->DLength);
+        }
+        else{
+            Result = readv(pendingread->DFileDescriptor, pendingread->DVectors.data(), pendingread->DVectors.size());
+        }
+    }while((-1 == Result) && (EINTR == errno));
+    MachineServerReply(mess, pendingread->DRequestID, Result);
+}
+
+void MachineServerQueueRead(int epollfd, TMachinePendingReadMap &pendingreads, SMachinePendingRead &pendingread, SMachineRequestRef mess){
+    TMachinePendingReadMap::iterator Search = pendingreads.find(pendingread.DFileDescriptor);
+    struct epoll_event Event;
+    
+    if(pendingreads.end() != Search){
+        Search->second.push_back(pendingread);
+        return;
+    }
+    Event.events = EPOLLIN;
+    Event.data.fd = pendingread.DFileDescriptor;
+    if(0 == epoll_ctl(epollfd, EPOLL_CTL_ADD, pendingread.DFileDescriptor, &Event)){
+        pendingreads[pendingread.DFileDescriptor].push_back(pendingread);
+        return;
+    }
+    // Regular files can't be watched but are always readable, bad 
+    // descriptors just fail the read
+    MachineServerRead(&pendingread, mess);
+}
+
+void MachineServerServiceRead(int epollfd, TMachinePendingReadMap &pendingreads, int fd, SMachineRequestRef mess){
+    TMachinePendingReadMap::iterator Search = pendingreads.find(fd);
+    SMachinePendingRead PendingRead;
+    
+    if(pendingreads.end() == Search){
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    PendingRead = Search->second.front();
+    Search->second.pop_front();
+    if(Search->second.empty()){
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+        pendingreads.erase(Search);
+    }
+    MachineServerRead(&PendingRead, mess);
+}
+
+void MachineServerCancelReads(int epollfd, TMachinePendingReadMap &pendingreads, int fd, SMachineRequestRef mess){
+    TMachinePendingReadMap::iterator Search = pendingreads.find(fd);
+    
+    if(pendingreads.end() == Search){
+        return;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    for(size_t Index = 0; Index < Search->second.size(); Index++){
+        MachineServerReply(mess, Search->second[Index].DRequestID, -1);
+    }
+    pendingreads.erase(Search);
+}
+
+// Takes a slot's window back. The kernel offset is past the window, so it 
+// is moved back to what the VM has consumed.
+void MachineServerReadAheadRetireSlot(int index){
+    SMachineReadAheadSlotRef Slot = MachineReadAheadSlot(index);
+    int64_t Position;
+    
+    if(Slot->DLength){
+        Position = Slot->DOffset + Slot->DConsumed;
+        if(Slot->DConsumed < Slot->DLength){
+            lseek(Slot->DFileDescriptor, Position, SEEK_SET);
+        }
+        MachineReadAheadStreams[Slot->DFileDescriptor].DNext = Position;
+        Slot->DLength = 0;
+    }
+}
+
+// Takes back the windows a request invalidates before it is serviced, the
+// slot's own window for most, every window when it advances the epoch. 
+// Anything but a read also ends the descriptor's sequential run.
+void MachineServerReadAheadRetire(SMachineRequestRef mess){
+    uint32_t Epoch = MachineReadAheadEpoch;
+    int Index = MachineReadAheadCountRequest(mess);
+    
+    if(Epoch != MachineReadAheadEpoch){
+        for(int SlotIndex = 0; SlotIndex < MACHINE_READAHEAD_SLOTS; SlotIndex++){
+            MachineServerReadAheadRetireSlot(SlotIndex);
+        }
+    }
+    else if(0 <= Index){
+        MachineServerReadAheadRetireSlot(Index);
+    }
+    if((0 <= Index) && (MACHINE_REQUEST_READ != mess->DType)){
+        MachineReadAheadStreams.erase(MachineGetInt(mess->DPayload));
+    }
+}
+
+// Services a read of a regular file directly, prefetching a whole window 
+// once the descriptor has been read sequentially. Returns false for reads 
+// that have to go through the epoll queue.
+bool MachineServerReadAhead(SMachinePendingReadRef pendingread, SMachineRequestRef mess){
+    int Index = pendingread->DFileDescriptor % MACHINE_READAHEAD_SLOTS;
+    std::unordered_map< int, SMachineReadAheadStream >::iterator Search;
+    SMachineReadAheadSlotRef Slot;
+    SMachineReadAheadStreamRef Stream;
+    struct stat FileStatus;
+    uint8_t *Data;
+    int Result, Length;
+    
+    if(!MachineData.DReadAheadWindow || (0 > pendingread->DFileDescriptor)){
+        return false;
+    }
+    Search = MachineReadAheadStreams.find(pendingread->DFileDescriptor);
+    if(MachineReadAheadStreams.end() == Search){
+        SMachineReadAheadStream NewStream = {-1, 0};
+        
+        if((0 == fstat(pendingread->DFileDescriptor, &FileStatus)) && S_ISREG(FileStatus.st_mode)){
+            NewStream.DNext = lseek(pendingread->DFileDescriptor, 0, SEEK_CUR);
+        }
+        Search = MachineReadAheadStreams.insert(std::make_pair(pendingread->DFileDescriptor, NewStream)).first;
+    }
+    Stream = &Search->second;
+    if(0 > Stream->DNext){
+        return false;
+    }
+    if((MACHINE_READAHEAD_TRIGGER > Stream->DStreak) || (MachineData.DReadAheadWindow <= pendingread->DLength)){
+        do{
+            Result = read(pendingread->DFileDescriptor, pendingread->DBuffer, pendingread->DLength);
+        }while((-1 == Result) && (EINTR == errno));
+        Length = Result;
+    }
+    else{
+        Data = MachineReadAheadData(Index);
+        do{
+            Result = read(pendingread->DFileDescriptor, Data, MachineData.DReadAheadWindow);
+        }while((-1 == Result) && (EINTR == errno));
+        Length = Result < pendingread->DLength ? Result : pendingread->DLength;
+        if(0 < Length){
+            memcpy(pendingread->DBuffer, Data, Length);
+        }
+        if(Length < Result){
+            Slot = MachineReadAheadSlot(Index);
+            Slot->DFileDescriptor = pendingread->DFileDescriptor;
+            Slot->DOffset = Stream->DNext;
+            Slot->DLength = Result;
+            Slot->DConsumed = Length;
+            Slot->DEpoch = MachineReadAheadEpoch;
+            __atomic_store_n(&Slot->DStamp, MachineReadAheadCount[Index], __ATOMIC_RELEASE);
+        }
+    }
+    if(0 > Result){
+        MachineReadAheadStreams.erase(Search);
+    }
+    else{
+        Stream->DNext += Result;
+        Stream->DStreak++;
+    }
+    MachineServerReply(mess, pendingread->DRequestID, Length);
+    return true;
+}
+
+void MachineRemoveChannels(void){
+    if(0 <= MachineData.DRequestChannel){
+        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
+    }
+    if(0 <= MachineData.DReplyChannel){
+        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
+    }
+}
+
+void *MachineMapRegion(size_t *size, int visibility, int hugepages);
+
+// Read-ahead is optional, so a failed mapping only turns it off
+void MachineReadAheadInitialize(void){
+    const char *Window = getenv("VM_MACHINE_READAHEAD");
+    
+    MachineData.DReadAheadWindow = Window ? atoi(Window) : 0;
+    MachineData.DReadAheadBase = NULL;
+    if(0 >= MachineData.DReadAheadWindow){
+        MachineData.DReadAheadWindow = 0;
+        return;
+    }
+    MachineData.DReadAheadSize = MACHINE_PAGE_SIZE + (size_t)MACHINE_READAHEAD_SLOTS * MachineData.DReadAheadWindow;
+    MachineData.DReadAheadBase = (uint8_t *)MachineMapRegion(&MachineData.DReadAheadSize, MAP_SHARED, false);
+    if(MAP_FAILED == MachineData.DReadAheadBase){
+        fprintf(stderr,"Failed to map read-ahead windows: %s\n", strerror(errno));
+        MachineData.DReadAheadBase = NULL;
+        MachineData.DReadAheadWindow = 0;
+    }
+}
+
+void *MachineMapRegion(size_t *size, int visibility, int hugepages){
+    void *Base;
+    
+    // Anonymous mappings are zero filled on first touch, so the cost does 
+    // not depend on the size
+    if(hugepages){
+        size_t HugeSize = ((MACHINE_HUGE_PAGE_SIZE - 1) + *size)/MACHINE_HUGE_PAGE_SIZE * MACHINE_HUGE_PAGE_SIZE;
+        
+        Base = mmap(NULL, HugeSize, PROT_READ | PROT_WRITE, visibility | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(MAP_FAILED != Base){
+            *size = HugeSize;
+            return Base;
+        }
+        fprintf(stderr,"Hugepages unavailable (%s), using transparent hugepages\n", strerror(errno));
+    }
+    *size = ((MACHINE_PAGE_SIZE - 1) + *size)/MACHINE_PAGE_SIZE * MACHINE_PAGE_SIZE;
+    Base = mmap(NULL, *size, PROT_READ | PROT_WRITE, visibility | MAP_ANONYMOUS, -1, 0);
+    if((MAP_FAILED != Base) && hugepages){
+        madvise(Base, *size, MADV_HUGEPAGE);
+    }
+    return Base;
+}
+
+void *MachineInitialize(size_t sharesize, size_t requestcapacity, int hugepages){
+    sigset_t SigStateSave;
+    struct sigaction OldSigAction, SigAction;
+    const char *Transport = getenv("VM_MACHINE_TRANSPORT");
+    
+    if(MachineInitialized){
+        return NULL;
+    }
+    
+    sigaction(SIGALRM, NULL, &MachineAlarmActionSave);
+    MachineHistogramInitialize();
+    MachineTraceInitialize();
+#ifdef MACHINE_URING
+    // File requests go straight to io_uring, no server process is needed
+    MachineData.DSharedBase = (uint8_t *)MachineUringInitialize(sharesize, requestcapacity, hugepages);
+    MachineInitialized = true;
+    return MachineData.DSharedBase;
+#endif
+    MachinePendingInitialize(requestcapacity);
+    // Covers every slot the capacity can grow to, pages are only touched
+    // once their slots are
+    MachineHistogramMapTimings(MACHINE_MAX_PENDING_SLOTS);
+    MachineData.DParentPID = getpid();
+    MachineData.DTransport = MACHINE_TRANSPORT_RING;
+    if(Transport && (0 == strcmp(Transport, "msgq"))){
+        MachineData.DTransport = MACHINE_TRANSPORT_MSGQ;
+    }
+    MachineData.DRequestChannel = -1;
+    MachineData.DReplyChannel = -1;
+    if(MACHINE_TRANSPORT_MSGQ == MachineData.DTransport){
+        MachineData.DRequestChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+        if(0 > MachineData.DRequestChannel){
+            fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
+            exit(1);
+        }
+        MachineData.DReplyChannel = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+        if(0 > MachineData.DReplyChannel){
+            MachineRemoveChannels();
+            fprintf(stderr,"Failed to create message queue: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    if(0 > pipe(MachineSignalPipe)){
+        MachineRemoveChannels();
+        fprintf(stderr,"Failed to create doorbell pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(MachineSignalPipe[0], F_SETFL, fcntl(MachineSignalPipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(MachineSignalPipe[1], F_SETFL, fcntl(MachineSignalPipe[1], F_GETFL) | O_NONBLOCK);
+    if(0 > pipe(MachineParentPipe)){
+        close(MachineSignalPipe[0]);
+        close(MachineSignalPipe[1]);
+        MachineRemoveChannels();
+        fprintf(stderr,"Failed to create parent pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    // Both mappings are created before the fork so the server inherits them
+    MachineData.DMapSize = sizeof(SMachineRings);
+    MachineData.DMapBase = (uint8_t *)MachineMapRegion(&MachineData.DMapSize, MAP_SHARED, false);
+    MachineData.DSharedSize = sharesize;
+    MachineData.DSharedBase = MAP_FAILED == MachineData.DMapBase ? (uint8_t *)MAP_FAILED : (uint8_t *)MachineMapRegion(&MachineData.DSharedSize, MAP_SHARED, hugepages);
+    if(MAP_FAILED == MachineData.DSharedBase){
+        if(MAP_FAILED != MachineData.DMapBase){
+            munmap(MachineData.DMapBase, MachineData.DMapSize);
+        }
+        close(MachineSignalPipe[0]);
+        close(MachineSignalPipe[1]);
+        close(MachineParentPipe[0]);
+        close(MachineParentPipe[1]);
+        MachineRemoveChannels();
+        fprintf(stderr,"Failed to map shared memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    MachineData.DRings = (SMachineRingsRef)MachineData.DMapBase;
+    MachineReadAheadInitialize();
+    
+    MachineBlockSignals(&SigStateSave);
+    
+    MachineData.DChildPID = fork();
+    if(0 == MachineData.DChildPID){
+        bool Terminated = false;
+        TMachinePendingReadMap PendingReads;
+        struct epoll_event Events[MACHINE_MAX_EVENTS];
+        struct epoll_event Event;
+        int EventPoll;
+        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        int Result, FileDescriptor, Length, Flags, Mode;
+        int Offset, Whence;
+        int64_t Position;
+        uint8_t *BufferPointer;
+        std::vector< struct iovec > Vectors;
+        
+        MachineData.DChildPID = getpid();
+        // Parent keeps the only write end, so its exit shows up as a hang up
+        close(MachineParentPipe[1]);
+        EventPoll = epoll_create1(0);
+        Event.events = EPOLLIN;
+        Event.data.fd = MachineSignalPipe[0];
+        epoll_ctl(EventPoll, EPOLL_CTL_ADD, MachineSignalPipe[0], &Event);
+        Event.events = EPOLLIN;
+        Event.data.fd = MachineParentPipe[0];
+        epoll_ctl(EventPoll, EPOLL_CTL_ADD, MachineParentPipe[0], &Event);
+        memset((void *)&SigAction, 0, sizeof(struct sigaction));
+        SigAction.sa_handler = MachineRequestSignalHandler;
+        sigemptyset(&SigAction.sa_mask);
+        sigaction(SIGUSR2, &SigAction, &OldSigAction);
+        if(MachineHistogramFormat){
+            // Only the VM has histograms to dump
+            signal(SIGQUIT, SIG_IGN);
+        }
+        sigprocmask(SIG_SETMASK, &SigStateSave, NULL);
+        while(!Terminated){
+            bool RequestsReady = false;
+            int Timeout = -1;
+            
+            if(MACHINE_TRANSPORT_RING == MachineData.DTransport){
+                // Advertise sleep before the final check so a request pushed 
+                // after the check always rings the doorbell
+                MachineReplyRingFlush();
+                Timeout = MachineReplyPollCheck();
+                if(!MachineReplyOverflow.empty()){
+                    Timeout = 1;
+                }
+                __atomic_store_n(&MachineData.DRings->DRequests.DSleeping, 1, __ATOMIC_SEQ_CST);
+                RequestsReady = MachineRequestRingReady();
+            }
+            Result = epoll_wait(EventPoll, Events, MACHINE_MAX_EVENTS, RequestsReady ? 0 : Timeout);
+            if(MACHINE_TRANSPORT_RING == MachineData.DTransport){
+                __atomic_store_n(&MachineData.DRings->DRequests.DSleeping, 0, __ATOMIC_SEQ_CST);
+            }
+            for(int Index = 0; Index < Result; Index++){
+                if(Events[Index].data.fd == MachineSignalPipe[0]){
+                    uint8_t TempBytes[64];
+
+                    while(0 < read(MachineSignalPipe[0], TempBytes, sizeof(TempBytes)));
+                    RequestsReady = true;
+                }
+                else if(Events[Index].data.fd == MachineParentPipe[0]){
+                    Terminated = true;
+                }
+                else{
+                    MachineServerServiceRead(EventPoll, PendingReads, Events[Index].data.fd, MessageRef);
+                }
+            }
+            if(RequestsReady){
+                SMachinePendingRead PendingRead;
+
+                while(true){
+                    if(MachineReceiveRequest(MessageRef, sizeof(Buffer))){
+                        MachineHistogramDequeue(MessageRef->DRequestID);
+                        MachineServerReadAheadRetire(MessageRef);
+                        switch(MessageRef->DType){
+                            case MACHINE_REQUEST_NONE:          break;
+                            case MACHINE_REQUEST_OPEN:          Flags = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + 1);
+                                                                Mode = MachineGetInt(MessageRef->DPayload + strlen((char *)MessageRef->DPayload) + sizeof(int) + 1);
+                                                                FileDescriptor = open((char *)MessageRef->DPayload, Flags, Mode);
+                                                                MachineSetInt(MessageRef->DPayload, FileDescriptor);
+                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
+                                                                break;
                             case MACHINE_REQUEST_READ:          PendingRead.DRequestID = MessageRef->DRequestID;
                                                                 PendingRead.DFileDescriptor = MachineGetInt(MessageRef->DPayload);
                                                                 PendingRead.DLength = MachineGetInt(MessageRef->DPayload + sizeof(int));
                                                                 PendingRead.DBuffer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(PendingRead.DBuffer) && (PendingRead.DLength <= MACHINE_MAX_TRANSFER_SIZE)){
-                                                                    Found = false;
-                                                                    for(size_t Index = 0; Index < PollFDs.size(); Index++){
-                                                                        if(PollFDs[Index].fd == PendingRead.DFileDescriptor){
-                                                                            Found = true;
-                                                                            break;
-                                                                        }
-                                                                    }
-                                                                    if(!Found){
-                                                                        struct pollfd NewReadFD;
-                                                                        
-                                                                        NewReadFD.fd = PendingRead.DFileDescriptor;
-                                                                        NewReadFD.events = POLLIN;
-                                                                        NewReadFD.revents = 0;
-                                                                        PollFDs.push_back(NewReadFD);
-                                                                    }
-                                                                    PendingReads.push_back(PendingRead);
+                                                                if(!MachineValidShareRange(PendingRead.DBuffer, PendingRead.DLength)){
+                                                                    MachineSetInt(MessageRef->DPayload, -1);
+                                                                    MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1); 
+                                                                }
+                                                                else if(!MachineServerReadAhead(&PendingRead, MessageRef)){
+                                                                    MachineServerQueueRead(EventPoll, PendingReads, PendingRead, MessageRef);
+                                                                }
+                                                                break;
+                            case MACHINE_REQUEST_WRITE:         FileDescriptor = MachineGetInt(MessageRef->DPayload);
+                                                                Length = MachineGetInt(MessageRef->DPayload + sizeof(int));
+                                                                BufferPointer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
+                                                                if(MachineValidShareRange(BufferPointer, Length)){
+                                                                    Result = MachineWriteAll(FileDescriptor, BufferPointer, Length);
+                                                                    MachineSetInt(MessageRef->DPayload, Result);
                                                                 }
                                                                 else{
                                                                     MachineSetInt(MessageRef->DPayload, -1);
-                                                                    MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1); 
                                                                 }
+                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
                                                                 break;
-                            case MACHINE_REQUEST_WRITE:         FileDescriptor = MachineGetInt(MessageRef->DPayload);
+                            case MACHINE_REQUEST_READAT:        FileDescriptor = MachineGetInt(MessageRef->DPayload);
                                                                 Length = MachineGetInt(MessageRef->DPayload + sizeof(int));
                                                                 BufferPointer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
-                                                                if(MachineValidSharePointer(BufferPointer) && (Length <= MACHINE_MAX_TRANSFER_SIZE)){
+                                                                Position = MachineGetLong(MessageRef->DPayload + sizeof(int) * 2 + sizeof(uint8_t *));
+                                                                Result = -1;
+                                                                // Positional reads fail on pipes, so they never wait on epoll
+                                                                if(MachineValidShareRange(BufferPointer, Length)){
                                                                     do{
-                                                                        Result = write(FileDescriptor, BufferPointer, Length);
+                                                                        Result = pread(FileDescriptor, BufferPointer, Length, Position);
                                                                     }while((-1 == Result) && (EINTR == errno));
+                                                                }
+                                                                MachineSetInt(MessageRef->DPayload, Result);
+                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
+                                                                break;
+                            case MACHINE_REQUEST_WRITEAT:       FileDescriptor = MachineGetInt(MessageRef->DPayload);
+                                                                Length = MachineGetInt(MessageRef->DPayload + sizeof(int));
+                                                                BufferPointer = MachineGetPointer(MessageRef->DPayload + sizeof(int) * 2);
+                                                                Position = MachineGetLong(MessageRef->DPayload + sizeof(int) * 2 + sizeof(uint8_t *));
+                                                                if(MachineValidShareRange(BufferPointer, Length)){
+                                                                    Result = MachineWriteAllAt(FileDescriptor, BufferPointer, Length, Position);
+                                                                    MachineSetInt(MessageRef->DPayload, Result);
+                                                                }
+                                                                else{
+                                                                    MachineSetInt(MessageRef->DPayload, -1);
+                                                                }
+                                                                MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
+                                                                break;
+                            case MACHINE_REQUEST_READV:         PendingRead.DRequestID = MessageRef->DRequestID;
+                                                                PendingRead.DFileDescriptor = MachineGetInt(MessageRef->DPayload);
+                                                                if(MachineGetIOVector(MessageRef->DPayload, PendingRead.DVectors)){
+                                                                    MachineServerQueueRead(EventPoll, PendingReads, PendingRead, MessageRef);
+                                                                }
+                                                                else{
+                                                                    MachineSetInt(MessageRef->DPayload, -1);
+                                                                    MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1); 
+                                                                }
+                                                                // Plain reads reuse PendingRead
+                                                                PendingRead.DVectors.clear();
+                                                                break;
+                            case MACHINE_REQUEST_WRITEV:        FileDescriptor = MachineGetInt(MessageRef->DPayload);
+                                                                if(MachineGetIOVector(MessageRef->DPayload, Vectors)){
+                                                                    Result = MachineWriteAllV(FileDescriptor, Vectors.data(), Vectors.size());
                                                                     MachineSetInt(MessageRef->DPayload, Result);
                                                                 }
                                                                 else{
@@ -399,7 +2061,9 @@ void *MachineInitialize(size_t sharesize){
                                                                 MachineSetInt(MessageRef->DPayload, Offset);
                                                                 MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
                                                                 break;
-                            case MACHINE_REQUEST_CLOSE:         FileDescriptor = close(MachineGetInt(MessageRef->DPayload));
+                            case MACHINE_REQUEST_CLOSE:         FileDescriptor = MachineGetInt(MessageRef->DPayload);
+                                                                MachineServerCancelReads(EventPoll, PendingReads, FileDescriptor, MessageRef);
+                                                                FileDescriptor = close(FileDescriptor);
                                                                 MachineSetInt(MessageRef->DPayload, FileDescriptor);
                                                                 MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
                                                                 break;
@@ -412,107 +2076,441 @@ void *MachineInitialize(size_t sharesize){
                     }   
                 }
             }
-            else if(0 == Result){
-                if(0 > kill(MachineData.DParentPID, 0)){
-                    if(ESRCH == errno){
-                        Terminated = true;
-                    }
-                }
-            }
-            for(size_t Index = 1; Index < PollFDs.size(); Index++){
-                if(PollFDs[Index].revents){
-                    for(size_t ReadIndex = 0; ReadIndex < PendingReads.size(); ReadIndex++){
-                        if(PendingReads[ReadIndex].DFileDescriptor == PollFDs[Index].fd){
-                            do{
-                                Result = read(PendingReads[ReadIndex].DFileDescriptor, PendingReads[ReadIndex].DBuffer, PendingReads[ReadIndex].DLength);
-                            }while((-1 == Result) && (EINTR == errno));
-                            MessageRef->DRequestID = PendingReads[ReadIndex].DRequestID;
-                            MachineSetInt(MessageRef->DPayload, Result);
-                            MachineSendReply(MessageRef,sizeof(SMachineRequest) + sizeof(int) - 1);
-                            PendingReads.erase(PendingReads.begin() + ReadIndex);
-                            break;
-                        }
-                    }
-                }
-            }
-            for(size_t Index = 1; Index < PollFDs.size();){
-                bool Found = false;
-                for(size_t ReadIndex = 0; ReadIndex < PendingReads.size(); ReadIndex++){
-                    if(PendingReads[ReadIndex].DFileDescriptor == PollFDs[Index].fd){
-                        Found = true;
-                    }
-                }
-                if(Found){
-                    Index++;
-                }
-                else{
-                    PollFDs.erase(PollFDs.begin() + Index);
-                }
-            }
+            MachineServerNotify();
         }
-        msgctl(MachineData.DRequestChannel, IPC_RMID, NULL);
-        msgctl(MachineData.DReplyChannel, IPC_RMID, NULL);
-        close(MachineData.DMMapFile);
-        unlink("./vm_shmem");
+        close(EventPoll);
+        close(MachineParentPipe[0]);
+        MachineRemoveChannels();
         sigaction(SIGUSR2, &OldSigAction, NULL);
-        MachineResumeSignals(&SigStateSave);
         close(MachineSignalPipe[0]);
         close(MachineSignalPipe[1]);
         exit(0);
     }
+    close(MachineParentPipe[0]);
     memset((void *)&SigAction, 0, sizeof(struct sigaction));
     SigAction.sa_handler = MachineReplySignalHandler;
     sigemptyset(&SigAction.sa_mask);
+    // Handlers may switch contexts and never return, so the kernel mask has 
+    // to stay open and nesting is sorted out by MachineSignalEnter
+    SigAction.sa_flags = SA_NODEFER;
     sigaction(SIGUSR2, &SigAction, &OldSigAction);
     MachineInitialized = true;
-    MachineResumeSignals(&SigStateSave);
+    sigprocmask(SIG_SETMASK, &SigStateSave, NULL);
     return MachineData.DSharedBase;
 }
 
 void MachineTerminate(void){
     if(MachineInitialized){
-        TMachineSignalState SignalState;
+        sigset_t SignalState;
         uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
         SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
         int Status;
         
-        MachineSuspendSignals(&SignalState);
+        MachineBlockSignals(&SignalState);
         
         sigaction(SIGALRM, &MachineAlarmActionSave, NULL);
+        if(MachineKickCallback){
+            sigaction(MACHINE_KICK_SIGNAL, &MachineKickActionSave, NULL);
+            MachineKickCallback = NULL;
+        }
         
+        if(MachineAlarmTimerCreated){
+            timer_delete(MachineAlarmTimer);
+            for(int Index = 1; Index < MachineProcessorCount; Index++){
+                timer_delete(MachineProcessorTimers[Index]);
+            }
+            MachineAlarmTimerCreated = false;
+        }
+        else{
+            ualarm(0,0);
+        }
+#ifdef MACHINE_URING
+        MachineUringTerminate();
+        MachinePrintStatistics();
+        MachineHistogramTerminate();
+        MachineTraceTerminate();
+        MachineInitialized = false;
+        sigprocmask(SIG_SETMASK, &SignalState, NULL);
+        return;
+#endif
         MessageRef->DType = MACHINE_REQUEST_TERMINATE;
-        ualarm(0,0);
         MessageRef->DRequestID = MachineAddRequest(NULL, NULL);
-        close(MachineData.DMMapFile);
-        Status = msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) - 1);
         wait(&Status);
-        MachineResumeSignals(&SignalState);
+        munmap(MachineData.DSharedBase, MachineData.DSharedSize);
+        munmap(MachineData.DMapBase, MachineData.DMapSize);
+        if(MachineData.DReadAheadBase){
+            munmap(MachineData.DReadAheadBase, MachineData.DReadAheadSize);
+        }
+        MachinePrintStatistics();
+        MachineHistogramTerminate();
+        MachineTraceTerminate();
+        MachinePendingTerminate();
+        close(MachineSignalPipe[0]);
+        close(MachineSignalPipe[1]);
+        close(MachineParentPipe[1]);
+        sigprocmask(SIG_SETMASK, &SignalState, NULL);
     }
     
 }
 
-void MachineEnableSignals(void){
-    sigset_t NewSigset, OldSigset;
+void MachineBlockSignals(sigset_t *oldset){
+    sigset_t NewSigset;
     sigfillset(&NewSigset);
-    sigprocmask(SIG_UNBLOCK, &NewSigset, &OldSigset);    
+    sigprocmask(SIG_BLOCK, &NewSigset, oldset);
+}
+
+void MachineDeferWork(int work){
+    __atomic_or_fetch(&MachineDeferredWork, work, __ATOMIC_SEQ_CST);
+}
+
+void MachineProcessorRelax(void){
+#if defined(__x86_64__)
+    __asm__ volatile("pause");
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// A stopped processor waits here with every signal blocked until the 
+// process exits
+void MachineProcessorPark(void){
+    sigset_t SigSet;
+    
+    sigfillset(&SigSet);
+    pthread_sigmask(SIG_BLOCK, &SigSet, NULL);
+    __atomic_add_fetch(&MachineProcessorsParked, 1, __ATOMIC_SEQ_CST);
+    while(true){
+        pause();
+    }
+}
+
+bool MachineProcessorStopping(void){
+    int Stopper = __atomic_load_n(&MachineProcessorStopper, __ATOMIC_SEQ_CST);
+    
+    return (0 <= Stopper) && (Stopper != MachineProcessorIndex);
+}
+
+// The holder may be descheduled by the host, so spinning gives way to it
+void MachineSpinLockAcquire(TMachineSpinLockRef lock){
+    int Spins = 0;
+    
+    if(1 == MachineProcessorCount){
+        return;
+    }
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)){
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED)){
+            if(MachineProcessorStopping()){
+                MachineProcessorPark();
+            }
+            if(MACHINE_LOCK_SPINS < ++Spins){
+                sched_yield();
+                Spins = 0;
+            }
+            else{
+                MachineProcessorRelax();
+            }
+        }
+    }
+}
+
+void MachineSpinLockRelease(TMachineSpinLockRef lock){
+    if(1 != MachineProcessorCount){
+        __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void MachineLockAcquire(void){
+    if((1 == MachineProcessorCount) || MachineLockHeld){
+        return;
+    }
+    MachineSpinLockAcquire(&MachineLock);
+    MachineLockHeld = 1;
+}
+
+void MachineLockRelease(void){
+    if(MachineLockHeld){
+        MachineLockHeld = 0;
+        MachineSpinLockRelease(&MachineLock);
+    }
+}
+
+// Returns true if the handler owns the critical section and should do its 
+// work now, otherwise the work is left for whoever leaves the section. The
+// lock is not taken yet, alarm and kick callbacks take it when they need it.
+bool MachineSignalEnter(int work){
+    if(MachineProcessorStopping()){
+        MachineProcessorPark();
+    }
+    if(MachineSignalsDeferred){
+        MachineDeferWork(work);
+        return false;
+    }
+    MachineSignalsDeferred = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return true;
+}
+
+// Leaves the critical section and replays deferred work one item at a time,
+// each item may switch contexts and the next thread to leave picks up the rest
+void MachineSignalLeave(void){
+    int Work;
+    
+    while(true){
+        MachineLockRelease();
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        MachineSignalsDeferred = 0;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&MachineDeferredWork, __ATOMIC_SEQ_CST)){
+            return;
+        }
+        // A handler that got in after the clear already replays the rest
+        if(MachineSignalsDeferred){
+            return;
+        }
+        MachineSignalsDeferred = 1;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        Work = __atomic_fetch_and(&MachineDeferredWork, ~MACHINE_DEFERRED_REPLY, __ATOMIC_SEQ_CST);
+        if(Work & MACHINE_DEFERRED_REPLY){
+            MachineLockAcquire();
+#ifdef MACHINE_URING
+            MachineUringReplyDrain();
+#else
+            MachineReplyDrain();
+#endif
+            continue;
+        }
+        Work = __atomic_fetch_and(&MachineDeferredWork, ~MACHINE_DEFERRED_ALARM, __ATOMIC_SEQ_CST);
+        if((Work & MACHINE_DEFERRED_ALARM) && MachineAlarmCallback){
+            MachineAlarmCallback(MachineAlarmCalldata); 
+            continue;
+        }
+        Work = __atomic_fetch_and(&MachineDeferredWork, ~MACHINE_DEFERRED_KICK, __ATOMIC_SEQ_CST);
+        if((Work & MACHINE_DEFERRED_KICK) && MachineKickCallback){
+            MachineKickCallback(MachineKickCalldata);
+        }
+    }
+}
+
+void MachineEnableSignals(void){
+    MachineSignalLeave();
+}
+
+// Every handler finishes its work, switching contexts included, before the
+// wait returns, so there is no wakeup to miss
+void MachineWaitForSignal(void){
+    pause();
+}
+
+void *MachineProcessorStart(void *param){
+    MachineProcessorIndex = (int)(intptr_t)param;
+    MachineProcessorTIDs[MachineProcessorIndex] = syscall(SYS_gettid);
+    __atomic_add_fetch(&MachineProcessorsStarted, 1, __ATOMIC_SEQ_CST);
+    // Like a new context the entry starts inside the critical section
+    MachineSignalsDeferred = 1;
+    MachineLockAcquire();
+    pthread_sigmask(SIG_SETMASK, &MachineProcessorSignals, NULL);
+    MachineProcessorEntry(MachineProcessorIndex);
+    return NULL;
+}
+
+void MachineStartProcessors(int count, TMachineProcessorEntry entry){
+    sigset_t SigSet;
+    int Started = 1;
+    
+    if(!MachineInitialized || (1 != MachineProcessorCount) || (1 >= count)){
+        return;
+    }
+    if(MACHINE_MAX_PROCESSORS < count){
+        count = MACHINE_MAX_PROCESSORS;
+    }
+    MachineProcessorEntry = entry;
+    MachineProcessorThreads[0] = pthread_self();
+    MachineProcessorTIDs[0] = syscall(SYS_gettid);
+    // New processors start with everything blocked until their index is set,
+    // and no handler may straddle the lock coming into use
+    sigfillset(&SigSet);
+    pthread_sigmask(SIG_BLOCK, &SigSet, &MachineProcessorSignals);
+    MachineProcessorCount = count;
+    for(int Index = 1; Index < count; Index++){
+        if(0 != pthread_create(&MachineProcessorThreads[Index], NULL, MachineProcessorStart, (void *)(intptr_t)Index)){
+            fprintf(stderr,"Failed to start processor %d\n", Index);
+            break;
+        }
+        Started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &MachineProcessorSignals, NULL);
+    while(__atomic_load_n(&MachineProcessorsStarted, __ATOMIC_SEQ_CST) < Started - 1){
+        sched_yield();
+    }
+    if(Started < count){
+        // Processors that never started must not be waited for or signaled
+        fprintf(stderr,"Running with %d processors\n", Started);
+        MachineProcessorCount = Started;
+    }
+}
+
+int MachineProcessor(void){
+    return MachineProcessorIndex;
+}
+
+void MachineStopProcessors(void){
+    if(1 == MachineProcessorCount){
+        return;
+    }
+    __atomic_store_n(&MachineProcessorStopper, MachineProcessorIndex, __ATOMIC_SEQ_CST);
+    // A processor running guest code only notices once it takes a signal
+    while(__atomic_load_n(&MachineProcessorsParked, __ATOMIC_SEQ_CST) < MachineProcessorCount - 1){
+        for(int Index = 0; Index < MachineProcessorCount; Index++){
+            if(Index != MachineProcessorIndex){
+                pthread_kill(MachineProcessorThreads[Index], SIGALRM);
+            }
+        }
+        usleep(100);
+    }
+}
+
+void MachineKickSignalHandler(int signum){
+    if(MachineSignalEnter(MACHINE_DEFERRED_KICK)){
+        if(MachineKickCallback){
+            MachineKickCallback(MachineKickCalldata);
+        }
+        MachineSignalLeave();
+    }
+}
+
+void MachineRequestKick(TMachineAlarmCallback callback, void *calldata){
+    struct sigaction NewAction;
+    
+    if(!MachineInitialized || MachineKickCallback){
+        return;
+    }
+    memset((void *)&NewAction, 0, sizeof(struct sigaction));
+    NewAction.sa_handler = MachineKickSignalHandler;
+    sigemptyset(&NewAction.sa_mask);
+    NewAction.sa_flags = SA_NODEFER;
+    MachineKickCallback = callback;
+    MachineKickCalldata = calldata;
+    sigaction(MACHINE_KICK_SIGNAL, &NewAction, &MachineKickActionSave);
+}
+
+// The caller is normally inside a critical section, so the target only 
+// gets in once it is left
+void MachineProcessorKick(int processor){
+    if(!MachineKickCallback || (0 > processor) || (MachineProcessorCount <= processor) || (MachineProcessorIndex == processor)){
+        return;
+    }
+    MachineStatisticsData.DProcessorKicks++;
+    pthread_kill(MachineProcessorThreads[processor], MACHINE_KICK_SIGNAL);
 }
 
 void MachineSuspendSignals(TMachineSignalStateRef sigstate){
-    sigset_t NewSigset;
-    sigfillset(&NewSigset);
-    sigprocmask(SIG_BLOCK, &NewSigset, sigstate);
+    *sigstate = MachineSignalsDeferred;
+    MachineSignalsDeferred = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    MachineLockAcquire();
 }
 
 void MachineResumeSignals(TMachineSignalStateRef sigstate){
-    sigset_t OldSigset;
+    if(!*sigstate){
+        MachineSignalLeave();
+    }
+}
+
+void MachineSubmitBatch(void){
+    TMachineSignalState SignalState;
+    
+    MachineSuspendSignals(&SignalState);
+#ifdef MACHINE_URING
+    MachineUringSubmitBatch();
+#endif
+    MachineBatchDepth++;
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFlush(void){
+    TMachineSignalState SignalState;
+    
+    MachineSuspendSignals(&SignalState);
+    if(MachineBatchDepth){
+        MachineBatchDepth--;
+    }
+#ifdef MACHINE_URING
+    MachineUringFlush();
+#endif
+    if((0 == MachineBatchDepth) && MachineBatchDoorbell){
+        MachineBatchDoorbell = false;
+        MachineWakeServer();
+    }
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineEnablePolling(useconds_t quietus){
+#ifdef MACHINE_URING
+    MachineUringEnablePolling(quietus);
+#else
+    // The message queue transport has nothing to poll cheaply
+    if(MachineInitialized && (MACHINE_TRANSPORT_RING == MachineData.DTransport)){
+        __atomic_store_n(&MachineData.DRings->DReplies.DPollQuietUS, quietus, __ATOMIC_SEQ_CST);
+    }
+#endif
+}
+
+void MachinePollReplies(void){
+#ifdef MACHINE_URING
+    MachineUringPollReplies();
+#else
+    if(MachineInitialized && (MACHINE_TRANSPORT_RING == MachineData.DTransport)){
+        SMachineReplyRingRef Ring = &MachineData.DRings->DReplies;
+        
+        // Count before looking so the server either sees this poll or its
+        // reply is found here
+        __atomic_store_n(&Ring->DPollCount, Ring->DPollCount + 1, __ATOMIC_SEQ_CST);
+        if(Ring->DTail != __atomic_load_n(&Ring->DHead, __ATOMIC_SEQ_CST)){
+            MachineReplyDrain();
+        }
+    }
+#endif
+}
+
+bool MachineRequestsPending(void){
+    return MachineStatisticsData.DRequests != MachineStatisticsData.DReplies;
+}
+
+void MachineGetStatistics(SMachineStatisticsRef stats){
+    TMachineSignalState SignalState;
+    
+    MachineSuspendSignals(&SignalState);
+    *stats = MachineStatisticsData;
+    MachineResumeSignals(&SignalState);
+}
 
-    sigprocmask(SIG_SETMASK, sigstate, &OldSigset);
+void MachinePrintStatistics(void){
+    if(getenv("VM_MACHINE_STATISTICS")){
+        fprintf(stderr,"Machine alarm signals %llu\n", (unsigned long long)MachineStatisticsData.DAlarmSignals);
+        if(MachineStatisticsData.DProcessorKicks){
+            fprintf(stderr,"Machine processor kicks %llu\n", (unsigned long long)MachineStatisticsData.DProcessorKicks);
+        }
+    }
+    if(getenv("VM_MACHINE_STATISTICS") && MachineStatisticsData.DRequests){
+        fprintf(stderr,"Machine requests %llu, request signals %llu (%.3f per request), replies %llu, reply signals %llu (%.3f per reply)\n", 
+                (unsigned long long)MachineStatisticsData.DRequests, (unsigned long long)MachineStatisticsData.DRequestSignals, 
+                (double)MachineStatisticsData.DRequestSignals / MachineStatisticsData.DRequests,
+                (unsigned long long)MachineStatisticsData.DReplies, (unsigned long long)MachineStatisticsData.DReplySignals,
+                MachineStatisticsData.DReplies ? (double)MachineStatisticsData.DReplySignals / MachineStatisticsData.DReplies : 0.0);
+    }
+    if(getenv("VM_MACHINE_STATISTICS") && (MachineStatisticsData.DReadAheadHits || MachineStatisticsData.DReadAheadMisses)){
+        fprintf(stderr,"Machine read-ahead hits %llu, misses %llu\n", (unsigned long long)MachineStatisticsData.DReadAheadHits, (unsigned long long)MachineStatisticsData.DReadAheadMisses);
+    }
 }
 
 void MachineAlarmSignalHandler(int signum){
-    if(MachineAlarmCallback){
-        MachineAlarmCallback(MachineAlarmCalldata); 
+    MachineStatisticsData.DAlarmSignals++;
+    if(MachineSignalEnter(MACHINE_DEFERRED_ALARM)){
+        if(MachineAlarmCallback){
+            MachineAlarmCallback(MachineAlarmCalldata); 
+        }
+        MachineSignalLeave();
     }
 }
 
@@ -522,17 +2520,67 @@ void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *
         
         memset((void *)&NewAction, 0, sizeof(struct sigaction));
         NewAction.sa_handler = MachineAlarmSignalHandler;
-        sigfillset(&NewAction.sa_mask);
-        sigdelset(&NewAction.sa_mask, SIGALRM);
+        sigemptyset(&NewAction.sa_mask);
         NewAction.sa_flags = SA_NODEFER;
     
         MachineAlarmCallback = callback;
         MachineAlarmCalldata = calldata;      
         sigaction(SIGALRM, &NewAction, &MachineAlarmActionSave);
-        ualarm(usec * 2, usec);
+        // CLOCK_MONOTONIC timer has no 1 second limit and does not drift 
+        // with wall clock changes, ualarm is only kept as a fallback
+        if(!MachineAlarmTimerCreated){
+            struct sigevent Event;
+            
+            memset((void *)&Event, 0, sizeof(struct sigevent));
+            Event.sigev_notify = SIGEV_SIGNAL;
+            Event.sigev_signo = SIGALRM;
+            if(1 == MachineProcessorCount){
+                MachineAlarmTimerCreated = 0 == timer_create(CLOCK_MONOTONIC, &Event, &MachineAlarmTimer);
+            }
+            else{
+                // Each processor is sent its own alarm so every one is preempted
+                Event.sigev_notify = SIGEV_THREAD_ID;
+                MachineAlarmTimerCreated = true;
+                for(int Index = 0; Index < MachineProcessorCount; Index++){
+                    Event._sigev_un._tid = MachineProcessorTIDs[Index];
+                    if(0 != timer_create(CLOCK_MONOTONIC, &Event, &MachineProcessorTimers[Index])){
+                        fprintf(stderr,"Failed to create alarm for processor %d: %s\n", Index, strerror(errno));
+                        exit(1);
+                    }
+                }
+                MachineAlarmTimer = MachineProcessorTimers[0];
+            }
+        }
+        MachineProgramAlarm(usec * 2, usec);
+    }
+}
+
+void MachineProgramAlarm(useconds_t delay, useconds_t interval){
+    if(MachineAlarmTimerCreated){
+        struct itimerspec TimerSpec;
+        
+        // A zero delay disarms the timer
+        TimerSpec.it_interval.tv_sec = interval / 1000000;
+        TimerSpec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+        TimerSpec.it_value.tv_sec = delay / 1000000;
+        TimerSpec.it_value.tv_nsec = (delay % 1000000) * 1000;
+        timer_settime(MachineAlarmTimer, 0, &TimerSpec, NULL);
+        // Other processors are staggered across the interval so their 
+        // ticks do not all contend for the lock at once
+        for(int Index = 1; Index < MachineProcessorCount; Index++){
+            useconds_t Stagger = delay ? delay + (uint64_t)interval * Index / MachineProcessorCount : 0;
+            
+            TimerSpec.it_value.tv_sec = Stagger / 1000000;
+            TimerSpec.it_value.tv_nsec = (Stagger % 1000000) * 1000;
+            timer_settime(MachineProcessorTimers[Index], 0, &TimerSpec, NULL);
+        }
+    }
+    else{
+        ualarm(delay, interval);
     }
 }
 
+#ifndef MACHINE_URING
 void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata){
     if(MachineInitialized){
         TMachineSignalState SignalState;
@@ -546,8 +2594,7 @@ void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCall
         
         MachineSuspendSignals(&SignalState);
         MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + strlen(filename) + sizeof(int), 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + strlen(filename) + sizeof(int));
         MachineResumeSignals(&SignalState);
     }
 }
@@ -564,9 +2611,10 @@ void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callba
         MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
         
         MachineSuspendSignals(&SignalState);
-        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        if(!MachineReadAheadHit(fd, data, length, callback, calldata)){
+            MessageRef->DRequestID = MachineAddRequest(callback, calldata);
+            MachineSendRequest(MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1);
+        }
         MachineResumeSignals(&SignalState);
     }
 }
@@ -584,8 +2632,79 @@ void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callb
         
         MachineSuspendSignals(&SignalState);
         MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) - 1);
+        MachineResumeSignals(&SignalState);
+    }
+}
+
+void MachineFileReadAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata){
+    if(MachineInitialized){
+        TMachineSignalState SignalState;
+        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        
+        MessageRef->DType = MACHINE_REQUEST_READAT;
+        MachineSetInt(MessageRef->DPayload, fd);
+        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
+        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        MachineSetLong(MessageRef->DPayload + sizeof(int) * 2 + sizeof(uint8_t *), offset);
+        
+        MachineSuspendSignals(&SignalState);
+        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) + sizeof(int64_t) - 1);
+        MachineResumeSignals(&SignalState);
+    }
+}
+
+void MachineFileWriteAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata){
+    if(MachineInitialized){
+        TMachineSignalState SignalState;
+        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        
+        MessageRef->DType = MACHINE_REQUEST_WRITEAT;
+        MachineSetInt(MessageRef->DPayload, fd);
+        MachineSetInt(MessageRef->DPayload + sizeof(int), length);
+        MachineSetPointer(MessageRef->DPayload + sizeof(int) * 2, (uint8_t *)data);
+        MachineSetLong(MessageRef->DPayload + sizeof(int) * 2 + sizeof(uint8_t *), offset);
+        
+        MachineSuspendSignals(&SignalState);
+        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + 2 * sizeof(int) + sizeof(uint8_t *) + sizeof(int64_t) - 1);
+        MachineResumeSignals(&SignalState);
+    }
+}
+
+void MachineFileReadV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata){
+    if(MachineInitialized){
+        TMachineSignalState SignalState;
+        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        int Length;
+        
+        MessageRef->DType = MACHINE_REQUEST_READV;
+        Length = MachineSetIOVector(MessageRef->DPayload, fd, vector, count);
+        
+        MachineSuspendSignals(&SignalState);
+        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + Length - 1);
+        MachineResumeSignals(&SignalState);
+    }
+}
+
+void MachineFileWriteV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata){
+    if(MachineInitialized){
+        TMachineSignalState SignalState;
+        uint8_t Buffer[MACHINE_MAX_MESSAGE_SIZE];
+        SMachineRequestRef MessageRef = (SMachineRequestRef)Buffer;
+        int Length;
+        
+        MessageRef->DType = MACHINE_REQUEST_WRITEV;
+        Length = MachineSetIOVector(MessageRef->DPayload, fd, vector, count);
+        
+        MachineSuspendSignals(&SignalState);
+        MessageRef->DRequestID = MachineAddRequest(callback, calldata);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + Length - 1);
         MachineResumeSignals(&SignalState);
     }
 }
@@ -603,8 +2722,7 @@ void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callba
         
         MachineSuspendSignals(&SignalState);
         MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + 3 * sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + 3 * sizeof(int) - 1);
         MachineResumeSignals(&SignalState);
     }
 }
@@ -620,10 +2738,10 @@ void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata){
         
         MachineSuspendSignals(&SignalState);
         MessageRef->DRequestID = MachineAddRequest(callback, calldata);
-        msgsnd(MachineData.DRequestChannel, MessageRef, sizeof(SMachineRequest) + sizeof(int) - 1, 0);
-        kill(MachineData.DChildPID, SIGUSR2);
+        MachineSendRequest(MessageRef, sizeof(SMachineRequest) + sizeof(int) - 1);
         MachineResumeSignals(&SignalState);
     }
 }
+#endif
 
 } // End of extern "C"
@@ -11,6 +11,7 @@ extern "C" {
 #include <stdint.h>
 
 typedef struct{
+    void *DStackPointer;
     jmp_buf DJumpBuffer;
 } SMachineContext, *SMachineContextRef;
 
@@ -22,27 +23,166 @@ typedef struct{
 #define MachineContextRestore(mcntx)                \
     longjmp((mcntx)->DJumpBuffer, 1)
 
-// switch machine context 
+// switch machine context saving only callee-saved registers, the floating
+// point control state and the stack pointer, x86-64 and aarch64 only
+void MachineContextSwitchRegisters(SMachineContextRef mcntxold, SMachineContextRef mcntxnew);
+
+// switch machine context, build with MACHINE_CONTEXT_REGISTERS defined to 
+// use the register only switch instead of setjmp/longjmp
+#ifdef MACHINE_CONTEXT_REGISTERS
+#define MachineContextSwitch(mcntxold,mcntxnew)    \
+    MachineContextSwitchRegisters((mcntxold), (mcntxnew))
+#else
 #define MachineContextSwitch(mcntxold,mcntxnew)    \
     if(setjmp((mcntxold)->DJumpBuffer) == 0) longjmp((mcntxnew)->DJumpBuffer, 1)
+#endif
 
 // create machine context 
 void MachineContextCreate(SMachineContextRef mcntxref, void (*entry)(void *), void *param, void *stackaddr, size_t stacksize);
 
 typedef void (*TMachineAlarmCallback)(void *calldata);
 typedef void (*TMachineFileCallback)(void *calldata, int result);
-typedef sigset_t TMachineSignalState, *TMachineSignalStateRef;
-void *MachineInitialize(size_t sharesize);
+// Saved critical section state, signals are deferred in user space rather
+// than blocked so entering and leaving needs no system call
+typedef int TMachineSignalState, *TMachineSignalStateRef;
+
+// Counts kept by the VM side of the Machine layer. Request signals are the
+// wakeups sent to the I/O server, reply signals are SIGUSR2 deliveries and
+// alarm signals are SIGALRM deliveries and processor kicks are reschedules
+// sent to another processor. Read-ahead hits are reads answered from a
+// prefetched window without a request, misses are reads sent to the server
+// while read-ahead is enabled.
+typedef struct{
+    uint64_t DRequests;
+    uint64_t DRequestSignals;
+    uint64_t DReplies;
+    uint64_t DReplySignals;
+    uint64_t DAlarmSignals;
+    uint64_t DProcessorKicks;
+    uint64_t DReadAheadHits;
+    uint64_t DReadAheadMisses;
+} SMachineStatistics, *SMachineStatisticsRef;
+
+// One segment of a vectored request, DBase has to lie in the shared memory 
+// returned by MachineInitialize. A request carries at most 
+// MACHINE_MAX_IO_VECTORS segments.
+#define MACHINE_MAX_IO_VECTORS  64
+typedef struct{
+    void *DBase;
+    int DLength;
+} SMachineIOVector, *SMachineIOVectorRef;
+
+// Event tracing. Setting VM_MACHINE_TRACE to a file name records events
+// into an in-memory ring that MachineTerminate writes to that file, the ring
+// keeps the newest VM_MACHINE_TRACE_EVENTS events (65536 by default). A %p
+// in the file name is replaced by the process ID. The file is a
+// SMachineTraceHeader followed by the events oldest first, and bin/vm-trace
+// converts it to Chrome trace-event JSON. The arguments of each event type
+// are listed next to it.
+#define MACHINE_TRACE_DISPATCH          1   // previous thread, next thread
+#define MACHINE_TRACE_TICK              2   // tick count
+#define MACHINE_TRACE_THREAD_STATE      3   // thread, old state, new state
+#define MACHINE_TRACE_MUTEX_ACQUIRE     4   // thread, mutex
+#define MACHINE_TRACE_MUTEX_WAIT        5   // thread, mutex, owner
+#define MACHINE_TRACE_MUTEX_RELEASE     6   // thread, mutex
+#define MACHINE_TRACE_REQUEST_SUBMIT    7   // request ID, request class
+#define MACHINE_TRACE_REQUEST_COMPLETE  8   // request ID, result
+
+// Request classes of MACHINE_TRACE_REQUEST_SUBMIT, vectored and positional
+// requests count as reads and writes
+#define MACHINE_TRACE_REQUEST_OPEN      0
+#define MACHINE_TRACE_REQUEST_READ      1
+#define MACHINE_TRACE_REQUEST_WRITE     2
+#define MACHINE_TRACE_REQUEST_SEEK      3
+#define MACHINE_TRACE_REQUEST_CLOSE     4
+#define MACHINE_TRACE_REQUEST_OTHER     5
+
+#define MACHINE_TRACE_MAGIC             "VMTRACE"
+#define MACHINE_TRACE_VERSION           1
+
+typedef struct{
+    char DMagic[8];
+    uint32_t DVersion;
+    uint32_t DEventSize;
+    uint64_t DRecorded;
+    uint64_t DCount;
+} SMachineTraceHeader, *SMachineTraceHeaderRef;
+
+typedef struct{
+    uint64_t DTimestamp;
+    uint32_t DType;
+    uint32_t DArguments[3];
+} SMachineTraceEvent, *SMachineTraceEventRef;
+
+void *MachineInitialize(size_t sharesize, size_t requestcapacity, int hugepages);
+unsigned int MachinePendingExhaustedCount(void);
+// Virtual processors. MachineStartProcessors runs entry on count - 1 new 
+// host threads and the caller becomes processor 0, it must be called 
+// outside a critical section before MachineRequestAlarm. Like a new context
+// entry starts inside a critical section and must call 
+// MachineEnableSignals once it is ready for signals. With more than one
+// processor a critical section also holds a lock shared by all of them, and
+// every processor gets its own alarm. MachineProgramAlarm only supports the
+// periodic alarm then. Alarm and kick callbacks start inside a critical
+// section that does not hold the lock yet, so a callback with nothing to do
+// never waits on another processor, MachineSuspendSignals takes it and it
+// must be held to switch contexts. Spinlocks guard anything else shared
+// between processors, they are taken inside a critical section and never
+// held across a context switch.
+typedef volatile int TMachineSpinLock, *TMachineSpinLockRef;
+void MachineSpinLockAcquire(TMachineSpinLockRef lock);
+void MachineSpinLockRelease(TMachineSpinLockRef lock);
+typedef void (*TMachineProcessorEntry)(int processor);
+void MachineStartProcessors(int count, TMachineProcessorEntry entry);
+int MachineProcessor(void);
+// MachineProcessorKick interrupts another processor so that it calls the
+// callback set by MachineRequestKick inside a critical section, like its
+// alarm would but without waiting for it. Kicks are not ticks.
+void MachineRequestKick(TMachineAlarmCallback callback, void *calldata);
+void MachineProcessorKick(int processor);
+// Parks every other processor for good so the caller can terminate, must be
+// called with signals suspended
+void MachineStopProcessors(void);
 void MachineTerminate(void);
 void MachineEnableSignals(void);
+// Blocks the host thread until a signal has been handled, must be called
+// outside a critical section
+void MachineWaitForSignal(void);
 void MachineSuspendSignals(TMachineSignalStateRef sigstate);
 void MachineResumeSignals(TMachineSignalStateRef sigstate);
 void MachineRequestAlarm(useconds_t usec, TMachineAlarmCallback callback, void *calldata);
+// Rearm the alarm set by MachineRequestAlarm, a zero delay stops it
+void MachineProgramAlarm(useconds_t delay, useconds_t interval);
 void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata);
+// A read that can be answered from the read-ahead window calls the callback
+// before returning
 void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
 void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata);
+// Positional versions of read and write, serviced with pread/pwrite so the
+// file offset is neither used nor moved. The offset must not be negative.
+void MachineFileReadAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata);
+// Scatter/gather versions of read and write, the server services each with
+// a single readv/writev and the callback gets the total transferred
+void MachineFileReadV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata);
+void MachineFileWriteV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata);
 void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata);
 void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata);
+// File requests made between MachineSubmitBatch and MachineFlush are queued
+// and the server is woken at most once, when the outermost batch is flushed.
+void MachineSubmitBatch(void);
+void MachineFlush(void);
+void MachineGetStatistics(SMachineStatisticsRef stats);
+// With a nonzero quiet period completions are expected to be picked up by 
+// MachinePollReplies, SIGUSR2 is only sent once the VM has not polled for 
+// that long. MachinePollReplies must be called with signals suspended.
+void MachineEnablePolling(useconds_t quietus);
+void MachinePollReplies(void);
+// True while a file request has been sent and its callback has not run yet
+bool MachineRequestsPending(void);
+// Records an event when tracing is enabled, must be called with signals 
+// suspended
+void MachineTrace(uint32_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2);
 
 
 #ifdef __cplusplus
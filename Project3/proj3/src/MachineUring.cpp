@@ -0,0 +1,554 @@
+#include "Machine.h"
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <vector>
+
+// io_uring implementation of the Machine file API. Requests are submitted
+// and reaped directly by the VM process, there is no forked I/O server. A
+// helper thread sleeps on an eventfd registered with the ring and raises
+// SIGUSR2 so completions are still delivered from signal context.
+
+extern "C"{
+
+#define MACHINE_URING_ENTRIES           256
+#define MACHINE_URING_MAX_REQUESTS      0x10000
+
+#define MACHINE_URING_REQUEST_OPEN      1
+#define MACHINE_URING_REQUEST_READ      2
+#define MACHINE_URING_REQUEST_WRITE     3
+#define MACHINE_URING_REQUEST_SEEK      4
+#define MACHINE_URING_REQUEST_CLOSE     5
+#define MACHINE_URING_REQUEST_READV     6
+#define MACHINE_URING_REQUEST_WRITEV    7
+
+// Must match MACHINE_DEFERRED_REPLY in Machine.cpp
+#define MACHINE_URING_DEFERRED_REPLY    0x01
+// Must match MACHINE_HISTOGRAM_TOTAL in Machine.cpp
+#define MACHINE_URING_HISTOGRAM_TOTAL   3
+
+typedef struct{
+    int DType;
+    int DFileDescriptor;
+    uint8_t *DBuffer;
+    int DLength;
+    int64_t DOffset;
+    int DTransferred;
+    int DResult;
+    uint64_t DSubmitted;
+    TMachineFileCallback DCallback;
+    void *DCalldata;
+} SMachineUringRequest, *SMachineUringRequestRef;
+
+typedef struct{
+    int DRingFD;
+    int DEventFD;
+    uint8_t *DSQBase;
+    size_t DSQSize;
+    uint8_t *DCQBase;
+    size_t DCQSize;
+    struct io_uring_sqe *DSQEntries;
+    size_t DSQEntriesSize;
+    volatile uint32_t *DSQHead;
+    volatile uint32_t *DSQTail;
+    uint32_t DSQMask;
+    uint32_t *DSQArray;
+    volatile uint32_t *DCQHead;
+    volatile uint32_t *DCQTail;
+    uint32_t DCQMask;
+    struct io_uring_cqe *DCQEntries;
+    uint8_t *DSharedBase;
+    size_t DSharedSize;
+    pthread_t DWaiterThread;
+    volatile bool DTerminating;
+} SMachineUringData, *SMachineUringDataRef;
+
+static SMachineUringData MachineUringData;
+static std::vector< SMachineUringRequest > MachineUringRequests;
+static std::vector< uint32_t > MachineUringFreeRequests;
+// Segments of vectored requests by request ID, the kernel reads them at 
+// submission and short writes advance them in place
+static std::vector< std::vector< struct iovec > > MachineUringVectors;
+static size_t MachineUringRequestCapacity = 0;
+static unsigned int MachineUringRequestsExhausted = 0;
+static int MachineUringBatchDepth = 0;
+static uint32_t MachineUringUnsubmitted = 0;
+extern SMachineStatistics MachineStatisticsData;
+static struct sigaction MachineUringActionSave;
+static volatile uint32_t MachineUringPollQuietUS = 0;
+static volatile uint32_t MachineUringPollCount = 0;
+// Histogram type of each request type, must match MACHINE_HISTOGRAM_* in 
+// Machine.cpp and the MACHINE_TRACE_REQUEST_* classes. The kernel does the 
+// queueing and service, so only the total from submission to callback is 
+// recorded.
+static const int MachineUringHistogramTypes[] = {-1, 0, 1, 2, 3, 4, 1, 2};
+
+void MachineUringReplySignalHandler(int signum);
+void MachineUringReplyDrain(void);
+void *MachineMapRegion(size_t *size, int visibility, int hugepages);
+void MachineBlockSignals(sigset_t *oldset);
+void MachineDeferWork(int work);
+bool MachineSignalEnter(int work);
+void MachineLockAcquire(void);
+void MachineSignalLeave(void);
+int MachineIOVectorAdvance(struct iovec *vector, int count, size_t bytes);
+uint64_t MachineHistogramClock(void);
+void MachineHistogramRecord(int type, int phase, uint64_t nanoseconds);
+
+uint32_t MachineUringAddRequest(int type, TMachineFileCallback callback, void *calldata){
+    SMachineUringRequest Request;
+    uint32_t Index;
+
+    MachineStatisticsData.DRequests++;
+    memset(&Request, 0, sizeof(Request));
+    Request.DType = type;
+    Request.DOffset = -1;
+    Request.DSubmitted = MachineHistogramClock();
+    Request.DCallback = callback;
+    Request.DCalldata = calldata;
+    if(MachineUringFreeRequests.empty()){
+        // The tables are reserved for the maximum, going past the capacity 
+        // only counts and nothing is allocated until the maximum is passed
+        if(MachineUringRequests.size() >= MachineUringRequestCapacity){
+            MachineUringRequestsExhausted++;
+        }
+        Index = MachineUringRequests.size();
+        MachineUringRequests.push_back(Request);
+    }
+    else{
+        Index = MachineUringFreeRequests.back();
+        MachineUringFreeRequests.pop_back();
+        MachineUringRequests[Index] = Request;
+    }
+    MachineTrace(MACHINE_TRACE_REQUEST_SUBMIT, Index, 0 > MachineUringHistogramTypes[type] ? MACHINE_TRACE_REQUEST_OTHER : MachineUringHistogramTypes[type], 0);
+    return Index;
+}
+
+void MachineUringEnter(void){
+    int Result;
+
+    while(MachineUringUnsubmitted){
+        MachineStatisticsData.DRequestSignals++;
+        Result = syscall(__NR_io_uring_enter, MachineUringData.DRingFD, MachineUringUnsubmitted, 0, 0, NULL, 0);
+        if(0 < Result){
+            MachineUringUnsubmitted -= Result;
+        }
+        else if((0 == Result) || ((EINTR != errno) && (EAGAIN != errno))){
+            break;
+        }
+    }
+}
+
+void MachineUringSubmitBatch(void){
+    MachineUringBatchDepth++;
+}
+
+void MachineUringFlush(void){
+    if(MachineUringBatchDepth){
+        MachineUringBatchDepth--;
+    }
+    if(0 == MachineUringBatchDepth){
+        MachineUringEnter();
+    }
+}
+
+void MachineUringSubmit(uint8_t opcode, int fd, const void *addr, uint32_t len, uint64_t off, uint32_t flags, uint32_t requestid){
+    uint32_t Tail = *MachineUringData.DSQTail;
+    uint32_t Index = Tail & MachineUringData.DSQMask;
+    struct io_uring_sqe *Entry = &MachineUringData.DSQEntries[Index];
+
+    memset(Entry, 0, sizeof(struct io_uring_sqe));
+    Entry->opcode = opcode;
+    Entry->fd = fd;
+    Entry->addr = (uint64_t)(uintptr_t)addr;
+    Entry->len = len;
+    Entry->off = off;
+    Entry->open_flags = flags;
+    Entry->user_data = requestid;
+    MachineUringData.DSQArray[Index] = Index;
+    __atomic_store_n(MachineUringData.DSQTail, Tail + 1, __ATOMIC_RELEASE);
+    MachineUringUnsubmitted++;
+    // A batch holds entries back until it is flushed or the queue fills
+    if(MachineUringBatchDepth && (MachineUringUnsubmitted < MACHINE_URING_ENTRIES)){
+        return;
+    }
+    MachineUringEnter();
+}
+
+void *MachineUringWaiter(void *param){
+    uint64_t Count;
+    uint32_t PollSeen, QuietUS;
+    struct timespec Delay;
+
+    while(!MachineUringData.DTerminating){
+        if(sizeof(Count) == read(MachineUringData.DEventFD, &Count, sizeof(Count))){
+            // Give a polling VM quiet periods to reap the completions until
+            // one passes without a poll
+            QuietUS = MachineUringPollQuietUS;
+            PollSeen = __atomic_load_n(&MachineUringPollCount, __ATOMIC_SEQ_CST);
+            while(!MachineUringData.DTerminating){
+                if(QuietUS){
+                    Delay.tv_sec = QuietUS / 1000000;
+                    Delay.tv_nsec = (QuietUS % 1000000) * 1000;
+                    nanosleep(&Delay, NULL);
+                }
+                if(__atomic_load_n(MachineUringData.DCQHead, __ATOMIC_SEQ_CST) == __atomic_load_n(MachineUringData.DCQTail, __ATOMIC_SEQ_CST)){
+                    break;
+                }
+                if(QuietUS && (PollSeen != __atomic_load_n(&MachineUringPollCount, __ATOMIC_SEQ_CST))){
+                    PollSeen = MachineUringPollCount;
+                    continue;
+                }
+                kill(getpid(), SIGUSR2);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+void MachineUringReplySignalHandler(int signum){
+    MachineStatisticsData.DReplySignals++;
+    if(MachineSignalEnter(MACHINE_URING_DEFERRED_REPLY)){
+        MachineLockAcquire();
+        MachineUringReplyDrain();
+        MachineSignalLeave();
+    }
+}
+
+void MachineUringReplyDrain(void){
+    // Head is reloaded every pass since a callback can switch to a thread 
+    // that reaps more completions before this frame resumes
+    while(*MachineUringData.DCQHead != __atomic_load_n(MachineUringData.DCQTail, __ATOMIC_ACQUIRE)){
+        uint32_t Head = *MachineUringData.DCQHead;
+        struct io_uring_cqe *Entry = &MachineUringData.DCQEntries[Head & MachineUringData.DCQMask];
+        uint32_t RequestID = (uint32_t)Entry->user_data;
+        int Result = Entry->res;
+        SMachineUringRequestRef Request;
+        TMachineFileCallback Callback;
+        void *Calldata;
+
+        __atomic_store_n(MachineUringData.DCQHead, Head + 1, __ATOMIC_RELEASE);
+        if(MachineUringRequests.size() <= RequestID){
+            fprintf(stderr,"\n*****UKNOWN Reply %u*****\n",RequestID);
+            continue;
+        }
+        Request = &MachineUringRequests[RequestID];
+        if(MACHINE_URING_REQUEST_SEEK == Request->DType){
+            Result = Request->DResult;
+        }
+        else if((MACHINE_URING_REQUEST_WRITE == Request->DType) && (0 < Result)){
+            // Finish short writes before reporting back, same as the server
+            Request->DTransferred += Result;
+            if(Request->DTransferred < Request->DLength){
+                MachineUringSubmit(IORING_OP_WRITE, Request->DFileDescriptor, Request->DBuffer + Request->DTransferred, Request->DLength - Request->DTransferred, 0 > Request->DOffset ? (uint64_t)-1 : Request->DOffset + Request->DTransferred, 0, RequestID);
+                continue;
+            }
+            Result = Request->DTransferred;
+        }
+        else if((MACHINE_URING_REQUEST_WRITEV == Request->DType) && (0 < Result)){
+            std::vector< struct iovec > &Vectors = MachineUringVectors[RequestID];
+            int Index;
+            
+            Request->DTransferred += Result;
+            if(Request->DTransferred < Request->DLength){
+                Index = MachineIOVectorAdvance(Vectors.data(), Vectors.size(), Result);
+                Vectors.erase(Vectors.begin(), Vectors.begin() + Index);
+                MachineUringSubmit(IORING_OP_WRITEV, Request->DFileDescriptor, Vectors.data(), Vectors.size(), (uint64_t)-1, 0, RequestID);
+                continue;
+            }
+            Result = Request->DTransferred;
+        }
+        else if(((MACHINE_URING_REQUEST_WRITE == Request->DType) || (MACHINE_URING_REQUEST_WRITEV == Request->DType)) && Request->DTransferred){
+            Result = Request->DTransferred;
+        }
+        if(0 > Result){
+            Result = -1;
+        }
+        Callback = Request->DCallback;
+        Calldata = Request->DCalldata;
+        if(Request->DSubmitted){
+            MachineHistogramRecord(MachineUringHistogramTypes[Request->DType], MACHINE_URING_HISTOGRAM_TOTAL, MachineHistogramClock() - Request->DSubmitted);
+        }
+        MachineUringFreeRequests.push_back(RequestID);
+        MachineStatisticsData.DReplies++;
+        MachineTrace(MACHINE_TRACE_REQUEST_COMPLETE, RequestID, Result, 0);
+        // Callback may switch contexts, so the ring must be consistent first
+        // and the completions behind this one are left to the next thread 
+        // that leaves the critical section
+        if(*MachineUringData.DCQHead != __atomic_load_n(MachineUringData.DCQTail, __ATOMIC_ACQUIRE)){
+            MachineDeferWork(MACHINE_URING_DEFERRED_REPLY);
+        }
+        if(Callback){
+            Callback(Calldata, Result);
+        }
+    }
+}
+
+void *MachineUringInitialize(size_t sharesize, size_t requestcapacity, int hugepages){
+    struct io_uring_params Params;
+    struct sigaction SigAction;
+    sigset_t SigStateSave;
+
+    memset(&Params, 0, sizeof(Params));
+    MachineUringData.DRingFD = syscall(__NR_io_uring_setup, MACHINE_URING_ENTRIES, &Params);
+    if(0 > MachineUringData.DRingFD){
+        fprintf(stderr,"Failed to create io_uring: %s\n", strerror(errno));
+        exit(1);
+    }
+    MachineUringData.DSQSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+    MachineUringData.DCQSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+    if(Params.features & IORING_FEAT_SINGLE_MMAP){
+        if(MachineUringData.DCQSize > MachineUringData.DSQSize){
+            MachineUringData.DSQSize = MachineUringData.DCQSize;
+        }
+        MachineUringData.DCQSize = MachineUringData.DSQSize;
+    }
+    MachineUringData.DSQBase = (uint8_t *)mmap(NULL, MachineUringData.DSQSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, MachineUringData.DRingFD, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == MachineUringData.DSQBase){
+        fprintf(stderr,"Failed to map io_uring: %s\n", strerror(errno));
+        exit(1);
+    }
+    MachineUringData.DCQBase = MachineUringData.DSQBase;
+    if(!(Params.features & IORING_FEAT_SINGLE_MMAP)){
+        MachineUringData.DCQBase = (uint8_t *)mmap(NULL, MachineUringData.DCQSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, MachineUringData.DRingFD, IORING_OFF_CQ_RING);
+        if(MAP_FAILED == MachineUringData.DCQBase){
+            fprintf(stderr,"Failed to map io_uring: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    MachineUringData.DSQEntriesSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+    MachineUringData.DSQEntries = (struct io_uring_sqe *)mmap(NULL, MachineUringData.DSQEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, MachineUringData.DRingFD, IORING_OFF_SQES);
+    if(MAP_FAILED == (void *)MachineUringData.DSQEntries){
+        fprintf(stderr,"Failed to map io_uring: %s\n", strerror(errno));
+        exit(1);
+    }
+    MachineUringData.DSQHead = (volatile uint32_t *)(MachineUringData.DSQBase + Params.sq_off.head);
+    MachineUringData.DSQTail = (volatile uint32_t *)(MachineUringData.DSQBase + Params.sq_off.tail);
+    MachineUringData.DSQMask = *(uint32_t *)(MachineUringData.DSQBase + Params.sq_off.ring_mask);
+    MachineUringData.DSQArray = (uint32_t *)(MachineUringData.DSQBase + Params.sq_off.array);
+    MachineUringData.DCQHead = (volatile uint32_t *)(MachineUringData.DCQBase + Params.cq_off.head);
+    MachineUringData.DCQTail = (volatile uint32_t *)(MachineUringData.DCQBase + Params.cq_off.tail);
+    MachineUringData.DCQMask = *(uint32_t *)(MachineUringData.DCQBase + Params.cq_off.ring_mask);
+    MachineUringData.DCQEntries = (struct io_uring_cqe *)(MachineUringData.DCQBase + Params.cq_off.cqes);
+
+    MachineUringData.DEventFD = eventfd(0, 0);
+    if((0 > MachineUringData.DEventFD) || (0 > syscall(__NR_io_uring_register, MachineUringData.DRingFD, IORING_REGISTER_EVENTFD, &MachineUringData.DEventFD, 1))){
+        fprintf(stderr,"Failed to register io_uring eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    MachineUringRequestCapacity = requestcapacity ? requestcapacity : MACHINE_URING_ENTRIES;
+    MachineUringRequestsExhausted = 0;
+    MachineUringRequests.reserve(MACHINE_URING_MAX_REQUESTS);
+    MachineUringFreeRequests.reserve(MACHINE_URING_MAX_REQUESTS);
+    MachineUringVectors.resize(MachineUringRequestCapacity);
+
+    // Nothing else maps this memory, it only has to be page aligned
+    MachineUringData.DSharedSize = sharesize;
+    MachineUringData.DSharedBase = (uint8_t *)MachineMapRegion(&MachineUringData.DSharedSize, MAP_PRIVATE, hugepages);
+    if(MAP_FAILED == MachineUringData.DSharedBase){
+        fprintf(stderr,"Failed to map shared memory: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    MachineBlockSignals(&SigStateSave);
+    memset((void *)&SigAction, 0, sizeof(struct sigaction));
+    SigAction.sa_handler = MachineUringReplySignalHandler;
+    sigemptyset(&SigAction.sa_mask);
+    SigAction.sa_flags = SA_NODEFER;
+    sigaction(SIGUSR2, &SigAction, &MachineUringActionSave);
+    // Waiter inherits the fully blocked mask so signals always land on the VM
+    MachineUringData.DTerminating = false;
+    pthread_create(&MachineUringData.DWaiterThread, NULL, MachineUringWaiter, NULL);
+    sigprocmask(SIG_SETMASK, &SigStateSave, NULL);
+    return MachineUringData.DSharedBase;
+}
+
+void MachineUringTerminate(void){
+    uint64_t Count = 1;
+
+    MachineUringData.DTerminating = true;
+    write(MachineUringData.DEventFD, &Count, sizeof(Count));
+    pthread_join(MachineUringData.DWaiterThread, NULL);
+    sigaction(SIGUSR2, &MachineUringActionSave, NULL);
+    munmap(MachineUringData.DSharedBase, MachineUringData.DSharedSize);
+    munmap(MachineUringData.DSQEntries, MachineUringData.DSQEntriesSize);
+    if(MachineUringData.DCQBase != MachineUringData.DSQBase){
+        munmap(MachineUringData.DCQBase, MachineUringData.DCQSize);
+    }
+    munmap(MachineUringData.DSQBase, MachineUringData.DSQSize);
+    close(MachineUringData.DEventFD);
+    close(MachineUringData.DRingFD);
+    if(MachineUringRequestsExhausted){
+        fprintf(stderr,"Machine pending request slots exhausted %u times, capacity grew to %zu\n", MachineUringRequestsExhausted, MachineUringRequests.size());
+    }
+}
+
+void MachineUringEnablePolling(useconds_t quietus){
+    MachineUringPollQuietUS = quietus;
+}
+
+void MachineUringPollReplies(void){
+    __atomic_store_n(&MachineUringPollCount, MachineUringPollCount + 1, __ATOMIC_SEQ_CST);
+    if(*MachineUringData.DCQHead != __atomic_load_n(MachineUringData.DCQTail, __ATOMIC_SEQ_CST)){
+        MachineUringReplyDrain();
+    }
+}
+
+unsigned int MachineUringExhaustedCount(void){
+    return MachineUringRequestsExhausted;
+}
+
+void MachineFileOpen(const char *filename, int flags, int mode, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_OPEN, callback, calldata);
+    MachineUringSubmit(IORING_OP_OPENAT, AT_FDCWD, filename, mode, 0, flags, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileRead(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_READ, callback, calldata);
+    MachineUringSubmit(IORING_OP_READ, fd, data, length, (uint64_t)-1, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileWrite(int fd, void *data, int length, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_WRITE, callback, calldata);
+    MachineUringRequests[RequestID].DFileDescriptor = fd;
+    MachineUringRequests[RequestID].DBuffer = (uint8_t *)data;
+    MachineUringRequests[RequestID].DLength = length;
+    MachineUringSubmit(IORING_OP_WRITE, fd, data, length, (uint64_t)-1, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+// Copies the segments into the request, returns the total length or -1 if
+// the vector is not usable
+int MachineUringSetVector(uint32_t requestid, SMachineIOVectorRef vector, int count){
+    std::vector< struct iovec > &Vectors = MachineUringVectors[requestid];
+    struct iovec Entry;
+    long long Total = 0;
+
+    Vectors.clear();
+    if((0 >= count) || (MACHINE_MAX_IO_VECTORS < count)){
+        return -1;
+    }
+    for(int Index = 0; Index < count; Index++){
+        if(0 > vector[Index].DLength){
+            return -1;
+        }
+        Entry.iov_base = vector[Index].DBase;
+        Entry.iov_len = vector[Index].DLength;
+        Vectors.push_back(Entry);
+        Total += vector[Index].DLength;
+    }
+    return INT_MAX < Total ? -1 : (int)Total;
+}
+
+void MachineUringSubmitVector(int type, int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+    int Length;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(type, callback, calldata);
+    // Sized for the capacity at initialization, only grows past it
+    if(MachineUringVectors.size() <= RequestID){
+        MachineUringVectors.resize(RequestID + 1);
+    }
+    Length = MachineUringSetVector(RequestID, vector, count);
+    MachineUringRequests[RequestID].DFileDescriptor = fd;
+    MachineUringRequests[RequestID].DLength = Length;
+    if(0 > Length){
+        // Fail through a NOP the same way a bad seek does
+        MachineUringRequests[RequestID].DType = MACHINE_URING_REQUEST_SEEK;
+        MachineUringRequests[RequestID].DResult = -1;
+        MachineUringSubmit(IORING_OP_NOP, -1, NULL, 0, 0, 0, RequestID);
+    }
+    else{
+        MachineUringSubmit(MACHINE_URING_REQUEST_READV == type ? IORING_OP_READV : IORING_OP_WRITEV, fd, MachineUringVectors[RequestID].data(), count, (uint64_t)-1, 0, RequestID);
+    }
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileReadV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata){
+    MachineUringSubmitVector(MACHINE_URING_REQUEST_READV, fd, vector, count, callback, calldata);
+}
+
+void MachineFileWriteV(int fd, SMachineIOVectorRef vector, int count, TMachineFileCallback callback, void *calldata){
+    MachineUringSubmitVector(MACHINE_URING_REQUEST_WRITEV, fd, vector, count, callback, calldata);
+}
+
+void MachineFileReadAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_READ, callback, calldata);
+    MachineUringSubmit(IORING_OP_READ, fd, data, length, offset, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileWriteAt(int fd, void *data, int length, int64_t offset, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_WRITE, callback, calldata);
+    MachineUringRequests[RequestID].DFileDescriptor = fd;
+    MachineUringRequests[RequestID].DBuffer = (uint8_t *)data;
+    MachineUringRequests[RequestID].DLength = length;
+    MachineUringRequests[RequestID].DOffset = offset;
+    MachineUringSubmit(IORING_OP_WRITE, fd, data, length, offset, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileSeek(int fd, int offset, int whence, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    // io_uring has no seek, do it inline and complete through a NOP so the
+    // callback still arrives asynchronously
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_SEEK, callback, calldata);
+    MachineUringRequests[RequestID].DResult = lseek(fd, offset, whence);
+    MachineUringSubmit(IORING_OP_NOP, -1, NULL, 0, 0, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+void MachineFileClose(int fd, TMachineFileCallback callback, void *calldata){
+    TMachineSignalState SignalState;
+    uint32_t RequestID;
+
+    MachineSuspendSignals(&SignalState);
+    RequestID = MachineUringAddRequest(MACHINE_URING_REQUEST_CLOSE, callback, calldata);
+    MachineUringSubmit(IORING_OP_CLOSE, fd, NULL, 0, 0, 0, RequestID);
+    MachineResumeSignals(&SignalState);
+}
+
+} // End of extern "C"
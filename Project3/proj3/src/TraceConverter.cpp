@@ -0,0 +1,242 @@
+#include "Machine.h"
+#include "VirtualMachine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+// Converts a trace written with VM_MACHINE_TRACE into Chrome trace-event
+// JSON, which chrome://tracing and ui.perfetto.dev both load. Each VM thread
+// gets a track of running/ready/waiting slices, requests and held mutexes
+// are async slices, and ticks are process wide instant events.
+//
+// vm-trace tracefile [jsonfile]
+
+#define TRACE_PROCESS_ID        1
+
+typedef struct{
+    uint64_t DStart;
+    uint32_t DState;
+    bool DValid;
+} STraceThread, *STraceThreadRef;
+
+typedef struct{
+    uint64_t DSequence;
+    uint32_t DThread;
+    uint32_t DClass;
+} STraceRequest, *STraceRequestRef;
+
+static FILE *TraceOutput;
+static bool TraceFirstEvent = true;
+static uint64_t TraceStart = 0;
+
+static const char *TraceStateNames[] = {"dead", "running", "ready", "waiting"};
+static const char *TraceRequestNames[] = {"open", "read", "write", "seek", "close", "other"};
+
+bool EventEarlier(const SMachineTraceEvent &left, const SMachineTraceEvent &right){
+    return left.DTimestamp < right.DTimestamp;
+}
+
+const char *TraceStateName(uint32_t state){
+    return state < sizeof(TraceStateNames) / sizeof(TraceStateNames[0]) ? TraceStateNames[state] : "unknown";
+}
+
+const char *TraceRequestName(uint32_t requestclass){
+    return requestclass <= MACHINE_TRACE_REQUEST_OTHER ? TraceRequestNames[requestclass] : "other";
+}
+
+// Trace-event timestamps are in microseconds
+double TraceTime(uint64_t timestamp){
+    return (timestamp - TraceStart) / 1000.0;
+}
+
+void TraceBeginEvent(void){
+    fprintf(TraceOutput, "%s\n", TraceFirstEvent ? "" : ",");
+    TraceFirstEvent = false;
+}
+
+void TraceThreadName(uint32_t thread){
+    TraceBeginEvent();
+    if(0 == thread){
+        fprintf(TraceOutput, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"idle\"}}", TRACE_PROCESS_ID, thread);
+    }
+    else if(1 == thread){
+        fprintf(TraceOutput, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"main\"}}", TRACE_PROCESS_ID, thread);
+    }
+    else{
+        fprintf(TraceOutput, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", TRACE_PROCESS_ID, thread, thread);
+    }
+}
+
+void TraceStateSlice(uint32_t thread, STraceThreadRef info, uint64_t end){
+    if(!info->DValid || (VM_THREAD_STATE_DEAD == info->DState)){
+        return;
+    }
+    TraceBeginEvent();
+    fprintf(TraceOutput, "{\"name\":\"%s\",\"cat\":\"state\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            TraceStateName(info->DState), TRACE_PROCESS_ID, thread, TraceTime(info->DStart), (end - info->DStart) / 1000.0);
+}
+
+void TraceInstant(const char *name, const char *category, uint32_t thread, uint64_t timestamp, const char *args){
+    TraceBeginEvent();
+    fprintf(TraceOutput, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"args\":{%s}}",
+            name, category, TRACE_PROCESS_ID, thread, TraceTime(timestamp), args);
+}
+
+void TraceAsync(const char *name, const char *category, char phase, uint32_t thread, const char *id, uint64_t timestamp, const char *args){
+    TraceBeginEvent();
+    fprintf(TraceOutput, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"id\":\"%s\",\"ts\":%.3f,\"args\":{%s}}",
+            name, category, phase, TRACE_PROCESS_ID, thread, id, TraceTime(timestamp), args);
+}
+
+int main(int argc, char *argv[]){
+    SMachineTraceHeader Header;
+    std::vector< SMachineTraceEvent > Events;
+    std::map< uint32_t, STraceThread > Threads;
+    std::map< uint32_t, STraceRequest > Requests;
+    std::map< uint32_t, uint32_t > MutexOwners;
+    uint32_t CurrentThread = 1;
+    uint64_t RequestSequence = 0;
+    char Name[64], Identifier[64], Arguments[128];
+    FILE *Input;
+
+    if((2 > argc) || (3 < argc)){
+        fprintf(stderr,"Syntax Error: vm-trace tracefile [jsonfile]\n");
+        return 1;
+    }
+    Input = fopen(argv[1], "rb");
+    if(!Input){
+        fprintf(stderr,"Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    if((1 != fread(&Header, sizeof(Header), 1, Input)) || memcmp(Header.DMagic, MACHINE_TRACE_MAGIC, sizeof(MACHINE_TRACE_MAGIC))){
+        fprintf(stderr,"%s is not a VM trace\n", argv[1]);
+        fclose(Input);
+        return 1;
+    }
+    if((MACHINE_TRACE_VERSION != Header.DVersion) || (sizeof(SMachineTraceEvent) != Header.DEventSize)){
+        fprintf(stderr,"%s has unsupported trace version %u\n", argv[1], Header.DVersion);
+        fclose(Input);
+        return 1;
+    }
+    Events.resize(Header.DCount);
+    if(Header.DCount && (Header.DCount != fread(Events.data(), sizeof(SMachineTraceEvent), Header.DCount, Input))){
+        fprintf(stderr,"%s is truncated\n", argv[1]);
+        fclose(Input);
+        return 1;
+    }
+    fclose(Input);
+    if(Header.DRecorded > Header.DCount){
+        fprintf(stderr,"Ring wrapped, the oldest %llu of %llu events were lost\n", (unsigned long long)(Header.DRecorded - Header.DCount), (unsigned long long)Header.DRecorded);
+    }
+
+    TraceOutput = stdout;
+    if(3 == argc){
+        TraceOutput = fopen(argv[2], "w");
+        if(!TraceOutput){
+            fprintf(stderr,"Failed to open %s\n", argv[2]);
+            return 1;
+        }
+    }
+    // Order by timestamp, the ring is normally sorted already
+    std::stable_sort(Events.begin(), Events.end(), EventEarlier);
+    if(!Events.empty()){
+        TraceStart = Events.front().DTimestamp;
+    }
+
+    fprintf(TraceOutput, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    TraceBeginEvent();
+    fprintf(TraceOutput, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"VM\"}}", TRACE_PROCESS_ID);
+    for(size_t Index = 0; Index < Events.size(); Index++){
+        SMachineTraceEvent &Event = Events[Index];
+
+        switch(Event.DType){
+            case MACHINE_TRACE_THREAD_STATE:{
+                    std::map< uint32_t, STraceThread >::iterator Search = Threads.find(Event.DArguments[0]);
+
+                    if(Threads.end() == Search){
+                        TraceThreadName(Event.DArguments[0]);
+                        Search = Threads.insert(std::make_pair(Event.DArguments[0], STraceThread())).first;
+                        Search->second.DValid = false;
+                    }
+                    TraceStateSlice(Event.DArguments[0], &Search->second, Event.DTimestamp);
+                    Search->second.DStart = Event.DTimestamp;
+                    Search->second.DState = Event.DArguments[2];
+                    Search->second.DValid = true;
+                    if(VM_THREAD_STATE_RUNNING == Event.DArguments[2]){
+                        CurrentThread = Event.DArguments[0];
+                    }
+                }
+                break;
+            case MACHINE_TRACE_DISPATCH:
+                CurrentThread = Event.DArguments[1];
+                snprintf(Arguments, sizeof(Arguments), "\"from\":%u", Event.DArguments[0]);
+                TraceInstant("dispatch", "sched", Event.DArguments[1], Event.DTimestamp, Arguments);
+                break;
+            case MACHINE_TRACE_TICK:
+                TraceBeginEvent();
+                fprintf(TraceOutput, "{\"name\":\"tick\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"p\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"args\":{\"tick\":%u}}",
+                        TRACE_PROCESS_ID, CurrentThread, TraceTime(Event.DTimestamp), Event.DArguments[0]);
+                break;
+            case MACHINE_TRACE_MUTEX_WAIT:
+                snprintf(Name, sizeof(Name), "wait mutex %u", Event.DArguments[1]);
+                snprintf(Arguments, sizeof(Arguments), "\"owner\":%u", Event.DArguments[2]);
+                TraceInstant(Name, "mutex", Event.DArguments[0], Event.DTimestamp, Arguments);
+                break;
+            case MACHINE_TRACE_MUTEX_ACQUIRE:
+                // Each mutex is one async track, held from acquire to release
+                snprintf(Name, sizeof(Name), "mutex %u", Event.DArguments[1]);
+                snprintf(Identifier, sizeof(Identifier), "mutex%u", Event.DArguments[1]);
+                snprintf(Arguments, sizeof(Arguments), "\"owner\":%u", Event.DArguments[0]);
+                TraceAsync(Name, "mutex", 'b', Event.DArguments[0], Identifier, Event.DTimestamp, Arguments);
+                MutexOwners[Event.DArguments[1]] = Event.DArguments[0];
+                break;
+            case MACHINE_TRACE_MUTEX_RELEASE:
+                if(MutexOwners.erase(Event.DArguments[1])){
+                    snprintf(Name, sizeof(Name), "mutex %u", Event.DArguments[1]);
+                    snprintf(Identifier, sizeof(Identifier), "mutex%u", Event.DArguments[1]);
+                    TraceAsync(Name, "mutex", 'e', Event.DArguments[0], Identifier, Event.DTimestamp, "");
+                }
+                break;
+            case MACHINE_TRACE_REQUEST_SUBMIT:{
+                    STraceRequest Request;
+
+                    // Request IDs are reused, so the async ID also counts submissions
+                    Request.DSequence = RequestSequence++;
+                    Request.DThread = CurrentThread;
+                    Request.DClass = Event.DArguments[1];
+                    Requests[Event.DArguments[0]] = Request;
+                    snprintf(Identifier, sizeof(Identifier), "request%u.%llu", Event.DArguments[0], (unsigned long long)Request.DSequence);
+                    snprintf(Arguments, sizeof(Arguments), "\"request\":%u", Event.DArguments[0]);
+                    TraceAsync(TraceRequestName(Request.DClass), "io", 'b', Request.DThread, Identifier, Event.DTimestamp, Arguments);
+                }
+                break;
+            case MACHINE_TRACE_REQUEST_COMPLETE:{
+                    std::map< uint32_t, STraceRequest >::iterator Search = Requests.find(Event.DArguments[0]);
+
+                    if(Requests.end() == Search){
+                        break;
+                    }
+                    snprintf(Identifier, sizeof(Identifier), "request%u.%llu", Event.DArguments[0], (unsigned long long)Search->second.DSequence);
+                    snprintf(Arguments, sizeof(Arguments), "\"result\":%d", (int)Event.DArguments[1]);
+                    TraceAsync(TraceRequestName(Search->second.DClass), "io", 'e', Search->second.DThread, Identifier, Event.DTimestamp, Arguments);
+                    Requests.erase(Search);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    // Close the slices still open at the end of the trace
+    for(std::map< uint32_t, STraceThread >::iterator Thread = Threads.begin(); Thread != Threads.end(); Thread++){
+        TraceStateSlice(Thread->first, &Thread->second, Events.empty() ? 0 : Events.back().DTimestamp);
+    }
+    fprintf(TraceOutput, "\n]}\n");
+    if(stdout != TraceOutput){
+        fclose(TraceOutput);
+    }
+    return 0;
+}
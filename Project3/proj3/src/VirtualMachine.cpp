@@ -3,6 +3,14 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <map>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/stat.h>
 
 extern "C" {
 	// Stuff for functions in headers
@@ -23,34 +31,68 @@ extern "C" {
 	typedef void (*TMachineAlarmCallback) (void* calldata);
 	typedef void (*TVMThreadEntry)(void*);
 	typedef void (*TMachineFileCallback)(void *calldata, int result);
-	typedef sigset_t TMachineSignalState, *TMachineSignalStateRef;
+	typedef int TMachineSignalState, *TMachineSignalStateRef;
 
 	TVMMainEntry VMLoadModule(const char* module);
 	void VMUnloadModule(void);
 
-	// Store the tickms arg that was passed when starting the program
+	// Store the tick period in microseconds that was passed when starting the program
 	volatile int tickTime;
 	// tickCount stores the number of ticks since start
 	volatile TVMTick totalTickCount = 0;
 
+	// In tickless mode ticks are counted off the monotonic clock, and the
+	// alarm is only armed for the next sleeper or when threads contend
+	#define TIMER_OFF		0
+	#define TIMER_PERIODIC	1
+	#define TIMER_ONESHOT	2
+	bool tickless = false;
+	struct timespec tickStart;
+	int timerMode = TIMER_PERIODIC;
+	TVMTick timerDeadline = 0;
+
 	// Struct for FileOpen
 	struct callBackDataStorage {
 			TVMThreadID id;
 			int* resultPtr;
 	};
+	// Ready and waiting threads are kept on intrusive lists, one per
+	// priority and linked through the threads themselves, so queueing never
+	// allocates. The bitmap has a bit for every non-empty level.
+	#define PRIORITY_LEVELS	64
+	struct prioList {
+			uint64_t bitmap;
+			TVMThreadID head[PRIORITY_LEVELS];
+			TVMThreadID tail[PRIORITY_LEVELS];
+	};
+
 	// TCB
 	class Thread {
 	public:
 			TVMThreadID id;
 			TVMThreadState state;
+			// prio is what the scheduler uses, raised above basePrio while
+			// a higher priority thread waits on a mutex this one holds
 			TVMThreadPriority prio;
+			TVMThreadPriority basePrio;
+			// Mutex this thread is blocked on and the ones it holds
+			TVMMutexID waitMutex;
+			TVMMutexID heldMutexes;
 			TVMThreadEntry entry;
 			void* args;
 			SMachineContext cntx;
 			TVMMemorySize memsize;
 			void* stackaddr;
-			int sleepCountdown;
-			int mtxWaitTime;
+			// Tick the timeout expires on and the slot in timerHeap, -1 if none
+			TVMTick wakeTick;
+			int timerSlot;
+			// Readied by an I/O completion and not yet run, so likely to
+			// issue its next request as soon as it runs
+			bool ioWoken;
+			// Links on the list this thread is queued on, if any
+			prioList* queue;
+			TVMThreadID next;
+			TVMThreadID prev;
 	};
 
 	class Mutex {
@@ -58,28 +100,366 @@ extern "C" {
 			TVMMutexID mtxId;
 			TVMThreadID owner;
 			bool isLocked;
-			std::vector<std::queue<unsigned int>> waitingQ;
+			prioList waitingQ;
+			// Next mutex held by the same owner
+			TVMMutexID nextHeld;
+	};
+
+	// Free range of the shared memory handed back by MachineInitialize
+	struct sharedBlock {
+			uint8_t* base;
+			TVMMemorySize size;
+	};
+
+	// Every virtual processor has its own run queues under its own lock and
+	// its own idle thread, an idle processor sleeps until it is kicked and
+	// then takes work from the others. Threads, mutexes, timers and I/O are
+	// guarded by the Machine lock, but a tick that finds nothing better to
+	// run only looks at the run queues and never waits for that lock.
+	struct processor {
+			// Level 0 only holds this processor's idle thread
+			prioList readyThreads;
+			TVMThreadID idle;
+			// Thread on the processor and its priority, read by others to
+			// know whom to kick
+			TVMThreadID running;
+			volatile TVMThreadPriority runningPrio;
+			// Ready threads other than the idle one, read without any lock
+			volatile int queued;
+			// Guards readyThreads and queued. Changing them also takes the
+			// Machine lock, so holding either one is enough to read them.
+			TMachineSpinLock lock;
+			// Kicked while idle and not rescheduled yet
+			bool kicked;
 	};
 
-	volatile TVMThreadID currThread = 1;
+	std::vector<processor> processors;
+	__thread processor* volatile thisCPU;
+	__thread volatile TVMThreadID currThread = 1;
 
 	std::vector<Thread> threadList;
-	std::vector<Mutex> mutexList;
-	// 1 = LOW, 2 = NORMAL, 3 = HIGH
-	std::vector<std::queue<unsigned int>> readyThreads;
-	std::vector<unsigned int> sleepingThreads;
+	// Queued threads point at the wait list, so mutexes must never move
+	std::deque<Mutex> mutexList;
+	// Every tick timeout, sleeps included, sits in a min-heap on the tick
+	// it expires, so a tick only looks at the threads that are due
+	std::vector<TVMThreadID> timerHeap;
+	// File data has to live in shared memory for the I/O server to see it
+	TVMMemorySize sharedSize;
+	std::vector<sharedBlock> sharedFree;
+	std::queue<unsigned int> sharedWaiters;
+	// Open while Machine requests are being queued. A thread that blocks on
+	// I/O hands the batch on to the next thread only if that one was woken
+	// by a completion too and will likely issue again. The server is woken
+	// at the first switch to anything else, idle included, or once the batch
+	// is IO_BATCH_DEADLINE_US old, so threads in an I/O loop share wakeups
+	// while a request never waits behind a thread that computes.
+	#define IO_BATCH_DEADLINE_US	100
+	volatile bool ioBatchOpen = false;
+	long long ioBatchStart;
+
+	long long elapsedUS();
+
+	void ioBatchBegin() {
+		if (!ioBatchOpen) {
+			ioBatchOpen = true;
+			ioBatchStart = elapsedUS();
+			MachineSubmitBatch();
+		}
+	}
+
+	void ioBatchFlush() {
+		if (ioBatchOpen) {
+			ioBatchOpen = false;
+			MachineFlush();
+		}
+	}
+
+	// With write-behind each descriptor gets a shared buffer split in two
+	// halves. VMFileWrite fills one half while the other is written out by
+	// an asynchronous Machine write, and a failed flush is reported by the
+	// next call on the descriptor. Only regular files are buffered, a reader
+	// of a pipe, FIFO or terminal may be waiting on every write.
+	#define WRITE_BEHIND_SIZE		0x400
+	#define WRITE_BEHIND_BUFFERED	0
+	#define WRITE_BEHIND_FAILED		1
+	#define WRITE_BEHIND_BYPASS		2
+	struct writeBehind {
+			uint8_t* buffers[2];
+			int active;
+			int used;
+			bool flushing;
+			int flushLength;
+			bool failed;
+			// Not a regular file, writes always bypass the buffer
+			bool bypass;
+			std::queue<unsigned int> waiters;
+	};
+	bool writeBehindEnabled = false;
+	std::map<int, writeBehind*> writeBehinds;
+	// Whether the descriptors VMFileOpen returned are regular files. The I/O
+	// server holds those, so fstat here would look at another descriptor.
+	std::map<int, bool> writeBehindRegular;
+	bool writeBehindReclaim();
+
+	// In polling mode completions are reaped whenever the scheduler runs and
+	// by the idle thread, SIGUSR2 only covers a VM that stops polling
+	bool ioPolling = false;
+	bool ioPollActive = false;
+
+	void ioPoll() {
+		if (!ioPolling || ioPollActive) { return; }
+		ioPollActive = true;
+		MachinePollReplies();
+		ioPollActive = false;
+	}
+
+	// Every state change goes through here so it shows up in the trace
+	void setThreadState(TVMThreadID id, TVMThreadState state) {
+		MachineTrace(MACHINE_TRACE_THREAD_STATE, id, threadList[id].state, state);
+		threadList[id].state = state;
+	}
+
+	void prioInit(prioList* list) {
+		list->bitmap = 0;
+		for (int i = 0; i < PRIORITY_LEVELS; i++) {
+			list->head[i] = VM_THREAD_ID_INVALID;
+			list->tail[i] = VM_THREAD_ID_INVALID;
+		}
+	}
+
+	void prioPush(prioList* list, TVMThreadID id) {
+		TVMThreadPriority prio = threadList[id].prio;
+		threadList[id].queue = list;
+		threadList[id].next = VM_THREAD_ID_INVALID;
+		threadList[id].prev = list->tail[prio];
+		if (list->tail[prio] == VM_THREAD_ID_INVALID) {
+			list->head[prio] = id;
+		} else {
+			threadList[list->tail[prio]].next = id;
+		}
+		list->tail[prio] = id;
+		list->bitmap |= 1ULL << prio;
+	}
+
+	// Unlinks a thread from whichever list it is on
+	void prioRemove(TVMThreadID id) {
+		Thread& thread = threadList[id];
+		prioList* list = thread.queue;
+		if (thread.prev == VM_THREAD_ID_INVALID) {
+			list->head[thread.prio] = thread.next;
+		} else {
+			threadList[thread.prev].next = thread.next;
+		}
+		if (thread.next == VM_THREAD_ID_INVALID) {
+			list->tail[thread.prio] = thread.prev;
+		} else {
+			threadList[thread.next].prev = thread.prev;
+		}
+		if (list->head[thread.prio] == VM_THREAD_ID_INVALID) {
+			list->bitmap &= ~(1ULL << thread.prio);
+		}
+		thread.queue = NULL;
+	}
+
+	TVMThreadID prioPop(prioList* list, int prio) {
+		TVMThreadID id = list->head[prio];
+		prioRemove(id);
+		return id;
+	}
+
+	int prioHighest(prioList* list) {
+		return list->bitmap ? 63 - __builtin_clzll(list->bitmap) : -1;
+	}
+
+	bool prioEmpty(prioList* list, int prio) {
+		return !(list->bitmap & (1ULL << prio));
+	}
+
+	void updateTimer();
+
+	// Wakes an idle processor to steal the new thread, otherwise kicks the
+	// one running the least important thread below prio. An idle processor
+	// is only kicked again once it has rescheduled.
+	void readyKick(TVMThreadPriority prio) {
+		int target = -1;
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			processor* cpu = &processors[i];
+			if (cpu == thisCPU) { continue; }
+			if (cpu->running == cpu->idle) {
+				if (cpu->kicked) { continue; }
+				target = i;
+				break;
+			}
+			if (cpu->runningPrio >= prio) { continue; }
+			if (target < 0 || cpu->runningPrio < processors[target].runningPrio) {
+				target = i;
+			}
+		}
+		if (target >= 0) {
+			processors[target].kicked = processors[target].running == processors[target].idle;
+			MachineProcessorKick(target);
+		}
+	}
+
+	// Idle threads always go back to their own processor, anything else
+	// to the one making it ready. A thread that will not run here right
+	// away, because it was preempted or this processor keeps running
+	// something at least as important, may go to another one.
+	void readyPush(TVMThreadID id) {
+		processor* cpu = thisCPU;
+		TVMThreadPriority prio = threadList[id].prio;
+		if (prio == VM_THREAD_PRIORITY_NONE) {
+			for (unsigned int i = 0; i < processors.size(); i++) {
+				if (processors[i].idle == id) {
+					cpu = &processors[i];
+					break;
+				}
+			}
+		}
+		MachineSpinLockAcquire(&cpu->lock);
+		if (prio != VM_THREAD_PRIORITY_NONE) {
+			cpu->queued++;
+		}
+		prioPush(&cpu->readyThreads, id);
+		MachineSpinLockRelease(&cpu->lock);
+		if (processors.size() > 1 && prio != VM_THREAD_PRIORITY_NONE && (id == currThread || (threadList[currThread].state == VM_THREAD_STATE_RUNNING && prio <= threadList[currThread].prio))) {
+			readyKick(prio);
+		}
+	}
+
+	TVMThreadID readyPop(processor* cpu, int prio) {
+		MachineSpinLockAcquire(&cpu->lock);
+		if (prio != VM_THREAD_PRIORITY_NONE) {
+			cpu->queued--;
+		}
+		TVMThreadID id = prioPop(&cpu->readyThreads, prio);
+		MachineSpinLockRelease(&cpu->lock);
+		return id;
+	}
+
+	// Processor whose run queue the list is, NULL for a mutex queue
+	processor* readyOwner(prioList* list) {
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			if (list == &processors[i].readyThreads) { return &processors[i]; }
+		}
+		return NULL;
+	}
+
+	// Takes a ready thread off whichever processor it is queued on
+	void readyRemove(TVMThreadID id) {
+		processor* cpu = readyOwner(threadList[id].queue);
+		MachineSpinLockAcquire(&cpu->lock);
+		cpu->queued--;
+		prioRemove(id);
+		MachineSpinLockRelease(&cpu->lock);
+	}
+
+	int readyHighest(processor* cpu) {
+		return prioHighest(&cpu->readyThreads);
+	}
+
+	// A queued thread moves to its new level on the same list
+	void setThreadPriority(TVMThreadID id, TVMThreadPriority prio) {
+		prioList* list = threadList[id].queue;
+		processor* cpu = readyOwner(list);
+		if (cpu != NULL) { MachineSpinLockAcquire(&cpu->lock); }
+		if (list != NULL) { prioRemove(id); }
+		threadList[id].prio = prio;
+		if (list != NULL) { prioPush(list, id); }
+		if (cpu != NULL) { MachineSpinLockRelease(&cpu->lock); }
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			if (processors[i].running == id) { processors[i].runningPrio = prio; }
+		}
+	}
+
+	// Own priority or that of the most important waiter on any held mutex
+	TVMThreadPriority inheritedPriority(TVMThreadID id) {
+		TVMThreadPriority prio = threadList[id].basePrio;
+		for (TVMMutexID m = threadList[id].heldMutexes; m != VM_MUTEX_ID_INVALID; m = mutexList[m].nextHeld) {
+			int top = prioHighest(&mutexList[m].waitingQ);
+			if (top > (int)prio) { prio = top; }
+		}
+		return prio;
+	}
+
+	// Recomputes a thread's priority and follows the change down the chain
+	// of owners it is blocked behind, until a priority stays the same
+	void refreshPriority(TVMThreadID id) {
+		while (id != VM_THREAD_ID_INVALID) {
+			TVMThreadPriority prio = inheritedPriority(id);
+			if (prio == threadList[id].prio) { break; }
+			setThreadPriority(id, prio);
+			if (threadList[id].waitMutex == VM_MUTEX_ID_INVALID) { break; }
+			id = mutexList[threadList[id].waitMutex].owner;
+		}
+	}
+
+	void mutexHold(TVMMutexID mutex, TVMThreadID id) {
+		mutexList[mutex].isLocked = true;
+		mutexList[mutex].owner = id;
+		mutexList[mutex].nextHeld = threadList[id].heldMutexes;
+		threadList[id].heldMutexes = mutex;
+		MachineTrace(MACHINE_TRACE_MUTEX_ACQUIRE, id, mutex, 0);
+	}
+
+	void mutexDrop(TVMMutexID mutex) {
+		TVMMutexID* link = &threadList[mutexList[mutex].owner].heldMutexes;
+		while (*link != mutex) {
+			link = &mutexList[*link].nextHeld;
+		}
+		*link = mutexList[mutex].nextHeld;
+		mutexList[mutex].isLocked = false;
+		mutexList[mutex].owner = VM_THREAD_ID_INVALID;
+	}
+
+	// Takes a thread off the mutex it waits on, the owner may lose the
+	// priority it inherited from it
+	void mutexWaitCancel(TVMThreadID id) {
+		TVMMutexID mutex = threadList[id].waitMutex;
+		prioRemove(id);
+		threadList[id].waitMutex = VM_MUTEX_ID_INVALID;
+		refreshPriority(mutexList[mutex].owner);
+	}
+
+	// Moves the best thread queued on another processor here if it beats
+	// everything this processor could run, returns the new local highest
+	int readySteal(int highest, int floor) {
+		processor* victim = NULL;
+		int best = highest > floor ? highest : floor;
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			if (&processors[i] == thisCPU || processors[i].queued == 0) { continue; }
+			int prio = readyHighest(&processors[i]);
+			if (prio > best) {
+				best = prio;
+				victim = &processors[i];
+			}
+		}
+		if (victim == NULL) { return highest; }
+		readyPush(readyPop(victim, best));
+		return best;
+	}
 
 	void dispatch(TVMThreadID next) {
 
 		if (threadList[currThread].state == VM_THREAD_STATE_READY) {
-			readyThreads[threadList[currThread].prio].push(threadList[currThread].id);
+			readyPush(currThread);
+		}
+
+		// The batch only waits for a thread that is about to issue again
+		if (ioBatchOpen && (!threadList[next].ioWoken || elapsedUS() - ioBatchStart >= IO_BATCH_DEADLINE_US)) {
+			ioBatchFlush();
 		}
+		threadList[next].ioWoken = false;
 
 		TVMThreadID prev = currThread;
 		currThread = next;
+		thisCPU->running = next;
+		thisCPU->runningPrio = threadList[next].prio;
+		MachineTrace(MACHINE_TRACE_DISPATCH, prev, next, 0);
 		//std::cout << "Going from " << prev << " to " << next << std::endl;
 
-		threadList[currThread].state = VM_THREAD_STATE_RUNNING;
+		setThreadState(currThread, VM_THREAD_STATE_RUNNING);
+		updateTimer();
 		MachineContextSwitch(&threadList[prev].cntx, &threadList[currThread].cntx);
 	}
 
@@ -87,52 +467,222 @@ extern "C" {
 
 		TVMThreadID nextThread;
 
-		if (scheduleEqualPrio == 1) {
-			if (readyThreads[threadList[currThread].prio].size() != 0) {
-				nextThread = readyThreads[threadList[currThread].prio].front();
-				readyThreads[threadList[currThread].prio].pop();
+		thisCPU->kicked = false;
+		ioPoll();
+
+		// A preempted thread keeps the CPU over anything of lower priority
+		int highest = readyHighest(thisCPU);
+		if (processors.size() > 1) {
+			int floor = threadList[currThread].state == VM_THREAD_STATE_READY ? threadList[currThread].prio : VM_THREAD_PRIORITY_NONE;
+			highest = readySteal(highest, floor);
+		}
+
+		// Polling can ready a higher priority thread, which a yield must not skip
+		if (scheduleEqualPrio == 1 && highest <= (int)threadList[currThread].prio) {
+			if (!prioEmpty(&thisCPU->readyThreads, threadList[currThread].prio)) {
+				nextThread = readyPop(thisCPU, threadList[currThread].prio);
 				dispatch(nextThread);
+			} else {
+				setThreadState(currThread, VM_THREAD_STATE_RUNNING);
 			}
 			return;
 		}
 
-		if (!readyThreads[3].empty()) {
-			nextThread = readyThreads[3].front();
-			readyThreads[3].pop();
-		} else if (!readyThreads[2].empty()) {
-			nextThread = readyThreads[2].front();
-			readyThreads[2].pop();
-		} else if (!readyThreads[1].empty()) {
-			nextThread = readyThreads[1].front();
-			readyThreads[1].pop();
-		} else {
-			nextThread = readyThreads[0].front();
-			readyThreads[0].pop();
+		if (threadList[currThread].state == VM_THREAD_STATE_READY && (int)threadList[currThread].prio > highest) {
+			setThreadState(currThread, VM_THREAD_STATE_RUNNING);
+			updateTimer();
+			return;
+		}
+
+		if (highest < 0) {
+			// Nothing else is ready, so the idle thread is the one running
+			setThreadState(currThread, VM_THREAD_STATE_RUNNING);
+			updateTimer();
+			return;
 		}
+		nextThread = readyPop(thisCPU, highest);
 
 		dispatch(nextThread);
 	}
 
+	long long elapsedUS() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (now.tv_sec - tickStart.tv_sec) * 1000000LL + (now.tv_nsec - tickStart.tv_nsec) / 1000;
+	}
+
+	// Tick comparisons survive the count wrapping around
+	bool timerBefore(TVMTick left, TVMTick right) {
+		return (int)(left - right) < 0;
+	}
+
+	void timerPlace(int slot, TVMThreadID id) {
+		timerHeap[slot] = id;
+		threadList[id].timerSlot = slot;
+	}
+
+	void timerSiftUp(int slot) {
+		TVMThreadID id = timerHeap[slot];
+		while (slot > 0) {
+			int parent = (slot - 1) / 2;
+			if (!timerBefore(threadList[id].wakeTick, threadList[timerHeap[parent]].wakeTick)) { break; }
+			timerPlace(slot, timerHeap[parent]);
+			slot = parent;
+		}
+		timerPlace(slot, id);
+	}
+
+	void timerSiftDown(int slot) {
+		TVMThreadID id = timerHeap[slot];
+		int size = timerHeap.size();
+		while (2 * slot + 1 < size) {
+			int child = 2 * slot + 1;
+			if (child + 1 < size && timerBefore(threadList[timerHeap[child+1]].wakeTick, threadList[timerHeap[child]].wakeTick)) {
+				child++;
+			}
+			if (!timerBefore(threadList[timerHeap[child]].wakeTick, threadList[id].wakeTick)) { break; }
+			timerPlace(slot, timerHeap[child]);
+			slot = child;
+		}
+		timerPlace(slot, id);
+	}
+
+	// Capacity is reserved per thread, so this never allocates
+	void timerAdd(TVMThreadID id, TVMTick wake) {
+		threadList[id].wakeTick = wake;
+		timerHeap.push_back(id);
+		timerSiftUp(timerHeap.size() - 1);
+	}
+
+	void timerRemove(TVMThreadID id) {
+		int slot = threadList[id].timerSlot;
+		TVMThreadID last = timerHeap.back();
+		timerHeap.pop_back();
+		threadList[id].timerSlot = -1;
+		if (last != id) {
+			timerPlace(slot, last);
+			timerSiftUp(slot);
+			timerSiftDown(threadList[last].timerSlot);
+		}
+	}
+
+	void advanceTicks(TVMTick ticks) {
+		totalTickCount += ticks;
+
+		while (!timerHeap.empty() && !timerBefore(totalTickCount, threadList[timerHeap[0]].wakeTick)) {
+			TVMThreadID id = timerHeap[0];
+			timerRemove(id);
+			// A timed mutex wait gives up its place, the waiter sees it
+			// does not own the mutex
+			if (threadList[id].waitMutex != VM_MUTEX_ID_INVALID) {
+				mutexWaitCancel(id);
+			}
+			setThreadState(id, VM_THREAD_STATE_READY);
+			readyPush(id);
+		}
+	}
+
+	// Catches the tick count up with the clock, ticks may have been skipped
+	void syncTicks() {
+		if (tickless) {
+			TVMTick now = elapsedUS() / tickTime;
+			if (now != totalTickCount) {
+				advanceTicks(now - totalTickCount);
+			}
+		}
+	}
+
+	// Picks the cheapest alarm that still serves the running thread: periodic
+	// only if another thread waits at its priority, otherwise a single alarm
+	// at the next deadline, or none at all
+	void updateTimer() {
+		if (!tickless) { return; }
+
+		int mode = TIMER_OFF;
+		TVMTick deadline = 0;
+		TVMThreadPriority prio = threadList[currThread].prio;
+		if (prio != VM_THREAD_PRIORITY_NONE && !prioEmpty(&thisCPU->readyThreads, prio)) {
+			mode = TIMER_PERIODIC;
+		} else {
+			if (!timerHeap.empty()) {
+				deadline = threadList[timerHeap[0]].wakeTick;
+				mode = TIMER_ONESHOT;
+			}
+			// An open I/O batch still has to be flushed by the next tick
+			if (ioBatchOpen && prio != VM_THREAD_PRIORITY_NONE) {
+				if (mode == TIMER_OFF || timerBefore(totalTickCount + 1, deadline)) { deadline = totalTickCount + 1; }
+				mode = TIMER_ONESHOT;
+			}
+		}
+		if (mode == timerMode && (mode != TIMER_ONESHOT || deadline == timerDeadline)) { return; }
+
+		timerMode = mode;
+		timerDeadline = deadline;
+		long long now = elapsedUS();
+		if (mode == TIMER_PERIODIC) {
+			MachineProgramAlarm((now / tickTime + 1) * tickTime - now, tickTime);
+		} else if (mode == TIMER_ONESHOT) {
+			long long delay = (long long)deadline * tickTime - now;
+			MachineProgramAlarm(delay > 0 ? delay : 1, 0);
+		} else {
+			MachineProgramAlarm(0, 0);
+		}
+	}
+
+	// Whether a tick on this processor would switch threads, only the run
+	// queues are looked at so the Machine lock is not needed
+	bool rescheduleWanted() {
+		TVMThreadPriority prio = thisCPU->runningPrio;
+		if (ioBatchOpen) { return true; }
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			processor* cpu = &processors[i];
+			if (cpu != thisCPU && cpu->queued == 0) { continue; }
+			MachineSpinLockAcquire(&cpu->lock);
+			int highest = readyHighest(cpu);
+			MachineSpinLockRelease(&cpu->lock);
+			// Threads of equal priority take turns on the same processor
+			if (cpu == thisCPU ? highest >= (int)prio : highest > (int)prio) { return true; }
+		}
+		return false;
+	}
+
 	void timerCallback(void* calldata) {
 		TMachineSignalState signalState;
+		// Only the first processor keeps time, the others take the Machine
+		// lock only if there is something to switch to
+		if (!tickless && thisCPU != &processors[0] && !rescheduleWanted()) {
+			return;
+		}
 		MachineSuspendSignals(&signalState);
-		totalTickCount++;
-
-		// Check on Sleeping Threads
-		for (unsigned int i = 0; i < sleepingThreads.size(); i++) {
-			threadList[sleepingThreads[i]].sleepCountdown -=1;
-			if (threadList[sleepingThreads[i]].sleepCountdown <= 0) {
-				threadList[sleepingThreads[i]].state = VM_THREAD_STATE_READY;
-				readyThreads[threadList[sleepingThreads[i]].prio].push(sleepingThreads[i]);
-				sleepingThreads.erase(sleepingThreads.begin()+i);
-				i--;
-			}
+		if (tickless) {
+			// A one shot alarm is spent once it fires
+			if (timerMode == TIMER_ONESHOT) { timerMode = TIMER_OFF; }
+			syncTicks();
+			MachineTrace(MACHINE_TRACE_TICK, totalTickCount, 0, 0);
+		} else if (thisCPU == &processors[0]) {
+			// Every processor is preempted, but only the first keeps time
+			advanceTicks(1);
+			MachineTrace(MACHINE_TRACE_TICK, totalTickCount, 0, 0);
 		}
 
 		// Check on mutex queues ?
 
+		ioBatchFlush();
+
 		if (threadList[currThread].state != VM_THREAD_STATE_DEAD) {
-			threadList[currThread].state = VM_THREAD_STATE_READY;
+			setThreadState(currThread, VM_THREAD_STATE_READY);
+		}
+		schedule(0);
+		MachineResumeSignals(&signalState);
+	}
+
+	// Another processor terminated the running thread or readied one that
+	// outranks it, which is dealt with now rather than at the next tick
+	void kickCallback(void* calldata) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		if (threadList[currThread].state != VM_THREAD_STATE_DEAD) {
+			setThreadState(currThread, VM_THREAD_STATE_READY);
 		}
 		schedule(0);
 		MachineResumeSignals(&signalState);
@@ -143,75 +693,609 @@ extern "C" {
 		MachineSuspendSignals(&signalState);
 		callBackDataStorage *args = (callBackDataStorage*) calldata;
 		*(args->resultPtr) = result;
-		threadList[args->id].state = VM_THREAD_STATE_READY;
-		readyThreads[threadList[args->id].prio].push(args->id);
-		if (threadList[args->id].prio > threadList[currThread].prio) {
-			threadList[currThread].state = VM_THREAD_STATE_READY;
+		setThreadState(args->id, VM_THREAD_STATE_READY);
+		threadList[args->id].ioWoken = true;
+		// A poll inside schedule can complete the thread that is switching
+		// out, schedule then treats it like a preempted thread
+		if (args->id != currThread) {
+			readyPush(args->id);
+		}
+		if (ioPollActive) {
+			// The scheduler that is polling picks the next thread
+		} else if (threadList[args->id].prio > threadList[currThread].prio) {
+			setThreadState(currThread, VM_THREAD_STATE_READY);
 			schedule(0);
+		} else {
+			updateTimer();
 		}
 		MachineResumeSignals(&signalState);
 	}
 
+	uint8_t* sharedAllocate(TVMMemorySize size) {
+		for (unsigned int i = 0; i < sharedFree.size(); i++) {
+			if (sharedFree[i].size >= size) {
+				uint8_t* base = sharedFree[i].base;
+				sharedFree[i].base += size;
+				sharedFree[i].size -= size;
+				if (sharedFree[i].size == 0) {
+					sharedFree.erase(sharedFree.begin()+i);
+				}
+				return base;
+			}
+		}
+		return NULL;
+	}
+
+	TVMMemorySize sharedLargest() {
+		TVMMemorySize largest = 0;
+		for (unsigned int i = 0; i < sharedFree.size(); i++) {
+			if (sharedFree[i].size > largest) { largest = sharedFree[i].size; }
+		}
+		return largest;
+	}
+
+	// Takes up to *size bytes and sets *size to what it got. Idle
+	// write-behind buffers are handed back first, then a smaller range is
+	// taken, and the thread only blocks while nothing at all is free.
+	uint8_t* sharedAcquire(TVMMemorySize* size) {
+		uint8_t* base;
+		while ((base = sharedAllocate(*size)) == NULL) {
+			if (writeBehindReclaim()) { continue; }
+			TVMMemorySize largest = sharedLargest();
+			if (largest > 0) {
+				*size = largest;
+				continue;
+			}
+			setThreadState(currThread, VM_THREAD_STATE_WAITING);
+			sharedWaiters.push((TVMThreadID)currThread);
+			schedule(0);
+		}
+		return base;
+	}
+
+	void sharedRelease(uint8_t* base, TVMMemorySize size) {
+		unsigned int i = 0;
+		while (i < sharedFree.size() && sharedFree[i].base < base) {
+			i++;
+		}
+		sharedBlock block = {base, size};
+		sharedFree.insert(sharedFree.begin()+i, block);
+		// Merge with the following and then the preceding range
+		if (i+1 < sharedFree.size() && sharedFree[i].base + sharedFree[i].size == sharedFree[i+1].base) {
+			sharedFree[i].size += sharedFree[i+1].size;
+			sharedFree.erase(sharedFree.begin()+i+1);
+		}
+		if (i > 0 && sharedFree[i-1].base + sharedFree[i-1].size == sharedFree[i].base) {
+			sharedFree[i-1].size += sharedFree[i].size;
+			sharedFree.erase(sharedFree.begin()+i);
+		}
+		while (!sharedWaiters.empty()) {
+			setThreadState(sharedWaiters.front(), VM_THREAD_STATE_READY);
+			readyPush(sharedWaiters.front());
+			sharedWaiters.pop();
+		}
+		updateTimer();
+	}
+
+	// Issues one Machine transfer on a shared buffer and blocks until it
+	// completes, a negative offset uses the file position
+	int fileTransfer(bool isWrite, int fd, uint8_t* buffer, int length, TVMFileOffset offset) {
+		int result;
+		callBackDataStorage cb;
+		cb.id = currThread;
+		cb.resultPtr = &result;
+		setThreadState(currThread, VM_THREAD_STATE_WAITING);
+		ioBatchBegin();
+		if (offset >= 0) {
+			if (isWrite) {
+				MachineFileWriteAt(fd, buffer, length, offset, &fileCallBack, &cb);
+			} else {
+				MachineFileReadAt(fd, buffer, length, offset, &fileCallBack, &cb);
+			}
+		} else if (isWrite) {
+			MachineFileWrite(fd, buffer, length, &fileCallBack, &cb);
+		} else {
+			MachineFileRead(fd, buffer, length, &fileCallBack, &cb);
+		}
+		schedule(0);
+		return result;
+	}
+
+	// Shared by VMFileRead/VMFileWrite and their positional versions.
+	// Transfers larger than the whole shared region are split up here,
+	// anything else is a single Machine request.
+	int fileTransferBuffer(bool isWrite, int fd, uint8_t* data, int length, TVMFileOffset offset) {
+		int total = 0;
+		TVMMemorySize acquired = (TVMMemorySize)length < sharedSize ? length : sharedSize;
+		uint8_t* buffer = acquired > 0 ? sharedAcquire(&acquired) : NULL;
+		int chunk = acquired;
+		while (total < length) {
+			int request = length - total < chunk ? length - total : chunk;
+			if (isWrite) {
+				memcpy(buffer, data + total, request);
+			}
+			int result = fileTransfer(isWrite, fd, buffer, request, offset < 0 ? offset : offset + total);
+			if (result < 0) {
+				if (total == 0) { total = -1; }
+				break;
+			}
+			if (!isWrite) {
+				memcpy(data + total, buffer, result);
+			}
+			total += result;
+			if (result < request) { break; }
+		}
+		if (buffer != NULL) { sharedRelease(buffer, chunk); }
+		return total;
+	}
+
+	// Vectored version of fileTransfer, the whole vector is one Machine request
+	int fileTransferV(bool isWrite, int fd, SMachineIOVector* segments, int count) {
+		int result;
+		callBackDataStorage cb;
+		cb.id = currThread;
+		cb.resultPtr = &result;
+		setThreadState(currThread, VM_THREAD_STATE_WAITING);
+		ioBatchBegin();
+		if (isWrite) {
+			MachineFileWriteV(fd, segments, count, &fileCallBack, &cb);
+		} else {
+			MachineFileReadV(fd, segments, count, &fileCallBack, &cb);
+		}
+		schedule(0);
+		return result;
+	}
+
+	// Lays up to limit bytes of the guest vector, from fragment index at
+	// offset, out back to back in the shared buffer with one segment per
+	// fragment. Returns the number of bytes mapped.
+	int ioVectorMap(SVMIOVectorRef vector, int count, int index, int offset, uint8_t* buffer, int limit, SMachineIOVector* segments, int* segmentCount) {
+		int mapped = 0;
+		*segmentCount = 0;
+		while (index < count && mapped < limit && *segmentCount < MACHINE_MAX_IO_VECTORS) {
+			int size = vector[index].DLength - offset;
+			if (size > limit - mapped) { size = limit - mapped; }
+			segments[*segmentCount].DBase = buffer + mapped;
+			segments[*segmentCount].DLength = size;
+			(*segmentCount)++;
+			mapped += size;
+			if (offset + size < vector[index].DLength) { break; }
+			index++;
+			offset = 0;
+			// Empty fragments don't need a segment
+			while (index < count && vector[index].DLength == 0) { index++; }
+		}
+		return mapped;
+	}
+
+	// Copies length bytes between the guest vector and the shared buffer and
+	// moves index/offset past them
+	void ioVectorCopy(bool toShared, SVMIOVectorRef vector, int count, int* index, int* offset, uint8_t* buffer, int length) {
+		while (length > 0 && *index < count) {
+			int size = vector[*index].DLength - *offset;
+			if (size > length) { size = length; }
+			uint8_t* data = (uint8_t*)vector[*index].DData + *offset;
+			if (toShared) {
+				memcpy(buffer, data, size);
+			} else {
+				memcpy(data, buffer, size);
+			}
+			buffer += size;
+			length -= size;
+			*offset += size;
+			if (*offset == vector[*index].DLength) {
+				(*index)++;
+				*offset = 0;
+			}
+		}
+	}
+
+	// Sums a guest vector, -1 if it is malformed or too large for an int
+	int ioVectorLength(SVMIOVectorRef vector, int count) {
+		long long total = 0;
+		for (int i = 0; i < count; i++) {
+			if (vector[i].DLength < 0 || (vector[i].DData == NULL && vector[i].DLength > 0)) { return -1; }
+			total += vector[i].DLength;
+		}
+		return total > INT_MAX ? -1 : (int)total;
+	}
+
+	// Shared by VMFileReadV and VMFileWriteV. Fragments are staged in one
+	// shared buffer so each pass is a single readv/writev in the server.
+	int fileTransferVector(bool isWrite, int fd, SVMIOVectorRef vector, int count, int size) {
+		SMachineIOVector segments[MACHINE_MAX_IO_VECTORS];
+		int segmentCount;
+		int index = 0, offset = 0;
+		int total = 0;
+		TVMMemorySize acquired = (TVMMemorySize)size < sharedSize ? size : sharedSize;
+		uint8_t* buffer = acquired > 0 ? sharedAcquire(&acquired) : NULL;
+		int chunk = acquired;
+		while (index < count && vector[index].DLength == 0) { index++; }
+		while (total < size) {
+			int limit = size - total < chunk ? size - total : chunk;
+			int request = ioVectorMap(vector, count, index, offset, buffer, limit, segments, &segmentCount);
+			if (isWrite) {
+				ioVectorCopy(true, vector, count, &index, &offset, buffer, request);
+			}
+			int result = fileTransferV(isWrite, fd, segments, segmentCount);
+			if (result < 0) {
+				if (total == 0) { total = -1; }
+				break;
+			}
+			if (!isWrite) {
+				ioVectorCopy(false, vector, count, &index, &offset, buffer, result);
+			}
+			total += result;
+			if (result < request) { break; }
+		}
+		if (buffer != NULL) { sharedRelease(buffer, chunk); }
+		return total;
+	}
+
+	void writeBehindCallBack(void *calldata, int result) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		writeBehind* wb = (writeBehind*) calldata;
+		bool preempt = false;
+		wb->flushing = false;
+		if (result < wb->flushLength) {
+			wb->failed = true;
+		}
+		while (!wb->waiters.empty()) {
+			TVMThreadID id = wb->waiters.front();
+			wb->waiters.pop();
+			setThreadState(id, VM_THREAD_STATE_READY);
+			if (id != currThread) {
+				readyPush(id);
+			}
+			if (threadList[id].prio > threadList[currThread].prio) {
+				preempt = true;
+			}
+		}
+		// The buffer can be reclaimed now, so a transfer waiting for shared
+		// memory gets another try
+		while (!sharedWaiters.empty()) {
+			TVMThreadID id = sharedWaiters.front();
+			sharedWaiters.pop();
+			setThreadState(id, VM_THREAD_STATE_READY);
+			if (id != currThread) {
+				readyPush(id);
+			}
+			if (threadList[id].prio > threadList[currThread].prio) {
+				preempt = true;
+			}
+		}
+		if (ioPollActive) {
+			// The scheduler that is polling picks the next thread
+		} else if (preempt) {
+			setThreadState(currThread, VM_THREAD_STATE_READY);
+			schedule(0);
+		} else {
+			updateTimer();
+		}
+		MachineResumeSignals(&signalState);
+	}
+
+	void writeBehindWait(writeBehind* wb) {
+		while (wb->flushing) {
+			setThreadState(currThread, VM_THREAD_STATE_WAITING);
+			wb->waiters.push((TVMThreadID)currThread);
+			schedule(0);
+		}
+	}
+
+	// Starts writing out the active half, the caller makes sure the other
+	// half is no longer in flight
+	void writeBehindFlush(int fd, writeBehind* wb) {
+		if (wb->used == 0) { return; }
+		wb->flushing = true;
+		wb->flushLength = wb->used;
+		ioBatchBegin();
+		MachineFileWrite(fd, wb->buffers[wb->active], wb->used, &writeBehindCallBack, wb);
+		wb->active ^= 1;
+		wb->used = 0;
+	}
+
+	// Writes out everything buffered for fd and waits for it, false if a
+	// flush failed since the last call
+	bool writeBehindSync(int fd) {
+		std::map<int, writeBehind*>::iterator it = writeBehinds.find(fd);
+		if (it == writeBehinds.end()) { return true; }
+		writeBehind* wb = it->second;
+		writeBehindWait(wb);
+		writeBehindFlush(fd, wb);
+		writeBehindWait(wb);
+		if (wb->failed) {
+			wb->failed = false;
+			return false;
+		}
+		return true;
+	}
+
+	void writeBehindRelease(int fd) {
+		std::map<int, writeBehind*>::iterator it = writeBehinds.find(fd);
+		if (it == writeBehinds.end()) { return; }
+		writeBehindWait(it->second);
+		if (it->second->buffers[0] != NULL) {
+			sharedRelease(it->second->buffers[0], WRITE_BEHIND_SIZE * 2);
+		}
+		delete it->second;
+		writeBehinds.erase(it);
+	}
+
+	// Hands the buffers of idle descriptors back to the shared region and
+	// starts writing out the ones that still hold data, so they are idle by
+	// the time their callback wakes the waiting transfers. The descriptor
+	// keeps its entry, so a failed flush is still reported. True if any
+	// memory was released.
+	bool writeBehindReclaim() {
+		bool released = false;
+		for (std::map<int, writeBehind*>::iterator it = writeBehinds.begin(); it != writeBehinds.end(); it++) {
+			writeBehind* wb = it->second;
+			if (wb->buffers[0] == NULL || wb->flushing) { continue; }
+			if (wb->used > 0) {
+				writeBehindFlush(it->first, wb);
+				continue;
+			}
+			sharedRelease(wb->buffers[0], WRITE_BEHIND_SIZE * 2);
+			wb->buffers[0] = NULL;
+			wb->buffers[1] = NULL;
+			released = true;
+		}
+		ioBatchFlush();
+		return released;
+	}
+
+	// Buffers a write if it fits, large writes and descriptors that could
+	// not get a buffer bypass write-behind once earlier data is written out
+	int writeBehindWrite(int fd, uint8_t* data, int length) {
+		std::map<int, writeBehind*>::iterator it = writeBehinds.find(fd);
+		writeBehind* wb;
+		if (it != writeBehinds.end()) {
+			wb = it->second;
+			if (wb->bypass) { return WRITE_BEHIND_BYPASS; }
+		} else {
+			// Descriptors the VM did not open, stdout included, are shared
+			// with the server, so they can be looked at here
+			std::map<int, bool>::iterator regular = writeBehindRegular.find(fd);
+			struct stat status;
+			bool bypass = regular != writeBehindRegular.end() ? !regular->second : fstat(fd, &status) != 0 || !S_ISREG(status.st_mode);
+			uint8_t* base = length <= WRITE_BEHIND_SIZE && !bypass ? sharedAllocate(WRITE_BEHIND_SIZE * 2) : NULL;
+			if (base == NULL && !bypass) { return WRITE_BEHIND_BYPASS; }
+			wb = new writeBehind();
+			wb->buffers[0] = base;
+			wb->buffers[1] = base == NULL ? NULL : base + WRITE_BEHIND_SIZE;
+			wb->active = 0;
+			wb->used = 0;
+			wb->flushing = false;
+			wb->failed = false;
+			wb->bypass = bypass;
+			writeBehinds[fd] = wb;
+			if (bypass) { return WRITE_BEHIND_BYPASS; }
+		}
+		if (wb->failed) {
+			wb->failed = false;
+			return WRITE_BEHIND_FAILED;
+		}
+		if (length > WRITE_BEHIND_SIZE) {
+			return writeBehindSync(fd) ? WRITE_BEHIND_BYPASS : WRITE_BEHIND_FAILED;
+		}
+		if (wb->used + length > WRITE_BEHIND_SIZE) {
+			writeBehindWait(wb);
+			writeBehindFlush(fd, wb);
+		}
+		// The buffer may have been reclaimed, possibly while this thread
+		// waited for the flush
+		if (wb->buffers[0] == NULL) {
+			uint8_t* base = sharedAllocate(WRITE_BEHIND_SIZE * 2);
+			if (base == NULL) { return WRITE_BEHIND_BYPASS; }
+			wb->buffers[0] = base;
+			wb->buffers[1] = base + WRITE_BEHIND_SIZE;
+		}
+		memcpy(wb->buffers[wb->active] + wb->used, data, length);
+		wb->used += length;
+		return WRITE_BEHIND_BUFFERED;
+	}
+
 	void skeleton(void* param) {
+		// threadList may move once another processor gets in
+		TVMThreadEntry entry = threadList[currThread].entry;
+		void* args = threadList[currThread].args;
 		MachineEnableSignals();
-		threadList[currThread].entry(threadList[currThread].args);
+		entry(args);
 		VMThreadTerminate(currThread);
 	}
 
+	bool readyAnywhere() {
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			if (processors[i].queued > 0) { return true; }
+		}
+		return false;
+	}
+
 	void idleFunction(void* param) {
-		while(true) {}
+		while(true) {
+			if (ioPolling && !MachineRequestsPending()) {
+				// Nothing can complete, so there is nothing to poll for
+				MachineWaitForSignal();
+			} else if (ioPolling) {
+				TMachineSignalState signalState;
+				MachineSuspendSignals(&signalState);
+				ioPoll();
+				if (thisCPU->queued > 0) {
+					setThreadState(currThread, VM_THREAD_STATE_READY);
+					schedule(0);
+				} else {
+					sched_yield();
+				}
+				MachineResumeSignals(&signalState);
+			} else if (processors.size() > 1) {
+				// Work queued elsewhere is taken now, anything queued later
+				// kicks this processor, whose handler then reschedules
+				if (readyAnywhere()) {
+					TMachineSignalState signalState;
+					MachineSuspendSignals(&signalState);
+					setThreadState(currThread, VM_THREAD_STATE_READY);
+					schedule(0);
+					MachineResumeSignals(&signalState);
+				} else {
+					MachineWaitForSignal();
+				}
+			} else {
+				// Replies and the alarm, tickless or not, arrive as signals
+				// whose handlers switch away from the idle thread
+				MachineWaitForSignal();
+			}
+		}
 	}
 
 	void VMCreateIdleThread() {
 		Thread *idleThread = new Thread();
-		idleThread->state = VM_THREAD_STATE_READY;
+		idleThread->state = VM_THREAD_STATE_DEAD;
 		idleThread->entry = &idleFunction;
 		idleThread->args = NULL;
 		idleThread->prio = VM_THREAD_PRIORITY_NONE;
 		idleThread->id = threadList.size();
-		idleThread->sleepCountdown = 0;
-		idleThread->mtxWaitTime = 0;
+		idleThread->wakeTick = 0;
+		idleThread->timerSlot = -1;
+		idleThread->ioWoken = false;
+		idleThread->queue = NULL;
+		idleThread->basePrio = idleThread->prio;
+		idleThread->waitMutex = VM_MUTEX_ID_INVALID;
+		idleThread->heldMutexes = VM_MUTEX_ID_INVALID;
 		idleThread->memsize = 0x100000;
 		idleThread->stackaddr = malloc(idleThread->memsize * sizeof(TVMMemorySize));
 		threadList.push_back(*idleThread);
+		setThreadState(idleThread->id, VM_THREAD_STATE_READY);
 		MachineContextCreate(&threadList[0].cntx, &skeleton, threadList[0].args,
 								threadList[0].stackaddr, threadList[0].memsize);
+		readyPush(idleThread->id);
 		return;
 	}
 
+	// The idle thread of every other processor runs on that processor's
+	// own host thread, so it needs no stack of its own
+	void VMCreateProcessorIdleThreads() {
+		for (unsigned int i = 1; i < processors.size(); i++) {
+			Thread *idleThread = new Thread();
+			idleThread->state = VM_THREAD_STATE_DEAD;
+			idleThread->entry = &idleFunction;
+			idleThread->args = NULL;
+			idleThread->prio = VM_THREAD_PRIORITY_NONE;
+			idleThread->id = threadList.size();
+			idleThread->wakeTick = 0;
+			idleThread->timerSlot = -1;
+			idleThread->ioWoken = false;
+			idleThread->queue = NULL;
+			idleThread->basePrio = idleThread->prio;
+			idleThread->waitMutex = VM_MUTEX_ID_INVALID;
+			idleThread->heldMutexes = VM_MUTEX_ID_INVALID;
+			idleThread->memsize = 0;
+			idleThread->stackaddr = NULL;
+			threadList.push_back(*idleThread);
+			processors[i].idle = idleThread->id;
+			processors[i].running = idleThread->id;
+		}
+	}
+
+	// Entered inside the critical section on the new processor's host thread
+	void processorStart(int index) {
+		thisCPU = &processors[index];
+		currThread = thisCPU->idle;
+		thisCPU->running = currThread;
+		thisCPU->runningPrio = VM_THREAD_PRIORITY_NONE;
+		setThreadState(currThread, VM_THREAD_STATE_RUNNING);
+		MachineEnableSignals();
+		idleFunction(NULL);
+	}
+
 	void VMCreateMainThread(TVMMainEntry VMMain, char* argv[]) {
 
 		Thread *mainThread = new Thread();
-		mainThread->state = VM_THREAD_STATE_RUNNING;
+		mainThread->state = VM_THREAD_STATE_DEAD;
 		mainThread->entry = (TVMThreadEntry) VMMain;
 		mainThread->args = argv;
 		mainThread->prio = VM_THREAD_PRIORITY_NORMAL;
 		mainThread->id = threadList.size();
-		mainThread->sleepCountdown = 0;
-		mainThread->mtxWaitTime = 0;
+		mainThread->wakeTick = 0;
+		mainThread->timerSlot = -1;
+		mainThread->ioWoken = false;
+		mainThread->queue = NULL;
+		mainThread->basePrio = mainThread->prio;
+		mainThread->waitMutex = VM_MUTEX_ID_INVALID;
+		mainThread->heldMutexes = VM_MUTEX_ID_INVALID;
 
 		threadList.push_back(*mainThread);
+		setThreadState(mainThread->id, VM_THREAD_STATE_RUNNING);
 	}
 
-	TVMStatus VMStart(int tickms, TVMMemorySize , int argc, char* argv[]) {
-		readyThreads.resize(4);
+	TVMStatus VMStart(int tickus, TVMMemorySize sharedsize, int requestslots, int pollus, int processorcount, unsigned int flags, int argc, char* argv[]) {
+		// Tickless timing and polling assume a single processor
+		if (processorcount > 1 && (pollus > 0 || (flags & VM_START_FLAG_TICKLESS))) {
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		processors.resize(processorcount > 1 ? processorcount : 1);
+		for (unsigned int i = 0; i < processors.size(); i++) {
+			prioInit(&processors[i].readyThreads);
+			processors[i].idle = 0;
+			processors[i].running = 0;
+			processors[i].runningPrio = VM_THREAD_PRIORITY_NONE;
+			processors[i].queued = 0;
+			processors[i].lock = 0;
+			processors[i].kicked = false;
+		}
+		thisCPU = &processors[0];
 
 		TVMMainEntry VMMain = VMLoadModule(argv[0]);
 
 		if (VMMain == NULL) {return VM_STATUS_FAILURE;}
 
-		tickTime = tickms;
-		MachineInitialize();
+		tickTime = tickus;
+		uint8_t* sharedBase = (uint8_t*) MachineInitialize(sharedsize, requestslots, flags & VM_START_FLAG_HUGEPAGES);
+		sharedSize = sharedsize;
+		sharedBlock whole = {sharedBase, sharedsize};
+		sharedFree.push_back(whole);
+		if (pollus > 0) {
+			ioPolling = true;
+			MachineEnablePolling(pollus);
+		}
+		writeBehindEnabled = flags & VM_START_FLAG_WRITEBEHIND;
 		MachineEnableSignals();
 
 		// create the idle and main thread;
 		VMCreateIdleThread();
 		VMCreateMainThread(VMMain, argv);
+		VMCreateProcessorIdleThreads();
+		timerHeap.reserve(threadList.size());
+		processors[0].running = currThread;
+		processors[0].runningPrio = threadList[currThread].prio;
+		MachineRequestKick(kickCallback, NULL);
+		MachineStartProcessors(processors.size(), processorStart);
 
 		// create alarm for tick incrementing
-		useconds_t tickus = tickms * 1000;
+		tickless = flags & VM_START_FLAG_TICKLESS;
+		clock_gettime(CLOCK_MONOTONIC, &tickStart);
 		MachineRequestAlarm(tickus, timerCallback, NULL);
+		updateTimer();
 		VMMain(argc, argv);
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		// Syncing can switch threads, which may close descriptors
+		std::vector<int> buffered;
+		for (std::map<int, writeBehind*>::iterator it = writeBehinds.begin(); it != writeBehinds.end(); it++) {
+			buffered.push_back(it->first);
+		}
+		for (unsigned int i = 0; i < buffered.size(); i++) {
+			writeBehindSync(buffered[i]);
+		}
+		if (processors.size() > 1) {
+			// The others are parked while this processor still holds the lock
+			ioBatchFlush();
+			MachineStopProcessors();
+		} else {
+			MachineResumeSignals(&signalState);
+			ioBatchFlush();
+		}
 		MachineTerminate();
 		VMUnloadModule();
 
@@ -225,7 +1309,20 @@ extern "C" {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
-		*tickmsref = tickTime;
+		// Sub-millisecond ticks still report at least 1ms
+		*tickmsref = tickTime < 1000 ? 1 : (tickTime + 500) / 1000;
+		MachineResumeSignals(&signalState);
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMTickUS(int *tickusref) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		if (tickusref == NULL) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+		*tickusref = tickTime;
 		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
 	}
@@ -237,6 +1334,7 @@ extern "C" {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
+		syncTicks();
 		*tickref = totalTickCount;
 		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
@@ -245,7 +1343,7 @@ extern "C" {
 	TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsize, TVMThreadPriority prio, TVMThreadIDRef tid) {
 		TMachineSignalState signalState;
 		MachineSuspendSignals(&signalState);
-		if (entry == NULL || tid == NULL) {
+		if (entry == NULL || tid == NULL || prio < VM_THREAD_PRIORITY_LOW || prio > VM_THREAD_PRIORITY_MAX) {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
@@ -258,9 +1356,15 @@ extern "C" {
 		thread->stackaddr = malloc(thread->memsize * sizeof(TVMMemorySize));
 		thread->id = threadList.size();
 		*tid = thread->id;
-		thread->sleepCountdown = 0;
-		thread->mtxWaitTime = 0;
+		thread->wakeTick = 0;
+		thread->timerSlot = -1;
+		thread->ioWoken = false;
+		thread->queue = NULL;
+		thread->basePrio = thread->prio;
+		thread->waitMutex = VM_MUTEX_ID_INVALID;
+		thread->heldMutexes = VM_MUTEX_ID_INVALID;
 		threadList.push_back(*thread);
+		timerHeap.reserve(threadList.size());
 		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
 	}
@@ -292,14 +1396,22 @@ extern "C" {
 			return VM_STATUS_ERROR_INVALID_ID;
 		}
 
+		// A queued thread would otherwise be linked in twice
+		if (threadList[thread].state != VM_THREAD_STATE_DEAD) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_STATE;
+		}
+
 		MachineContextCreate(&threadList[thread].cntx, &skeleton, threadList[thread].args,
 			threadList[thread].stackaddr, threadList[thread].memsize);
 
-		threadList[thread].state = VM_THREAD_STATE_READY;
-		readyThreads[threadList[thread].prio].push(threadList[thread].id);
+		setThreadState(thread, VM_THREAD_STATE_READY);
+		readyPush(threadList[thread].id);
 		if (threadList[thread].prio > threadList[currThread].prio) {
-			threadList[currThread].state = VM_THREAD_STATE_READY;
+			setThreadState(currThread, VM_THREAD_STATE_READY);
 			schedule(0);
+		} else {
+			updateTimer();
 		}
 		MachineResumeSignals(&signalState);
 
@@ -320,8 +1432,26 @@ extern "C" {
 			return VM_STATUS_ERROR_INVALID_STATE;
 		}
 
-		threadList[thread].state = VM_THREAD_STATE_DEAD;
-		if (thread == currThread) { schedule(0); }
+		// Ready or waiting on a mutex, either way it must not be picked again
+		if (threadList[thread].waitMutex != VM_MUTEX_ID_INVALID) {
+			mutexWaitCancel(thread);
+		} else if (threadList[thread].queue != NULL) {
+			readyRemove(thread);
+		}
+		if (threadList[thread].timerSlot >= 0) {
+			timerRemove(thread);
+		}
+		setThreadState(thread, VM_THREAD_STATE_DEAD);
+		if (thread == currThread) {
+			schedule(0);
+		} else {
+			// Running elsewhere, that processor has to switch away from it
+			for (unsigned int i = 0; i < processors.size(); i++) {
+				if (processors[i].running == thread) {
+					MachineProcessorKick(i);
+				}
+			}
+		}
 
 		MachineResumeSignals(&signalState);
 
@@ -342,11 +1472,15 @@ extern "C" {
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
 
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
 		if (thread > threadList.size()-1 || thread < 0) {
+			MachineResumeSignals(&signalState);
 			return VM_STATUS_ERROR_INVALID_ID;
 		}
 
 		*stateref = threadList[thread].state;
+		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
 	}
 
@@ -359,12 +1493,13 @@ extern "C" {
 		}
 
 		if (tick == VM_TIMEOUT_IMMEDIATE) {
-			threadList[currThread].state = VM_THREAD_STATE_READY;
+			setThreadState(currThread, VM_THREAD_STATE_READY);
 			schedule(1);
 		} else {
-			threadList[currThread].state = VM_THREAD_STATE_WAITING;
-			threadList[currThread].sleepCountdown = tick;
-			sleepingThreads.push_back(threadList[currThread].id);
+			// Countdown is relative to the tick count, which may be stale
+			syncTicks();
+			setThreadState(currThread, VM_THREAD_STATE_WAITING);
+			timerAdd(currThread, totalTickCount + tick);
 			schedule(0);
 		}
 		MachineResumeSignals(&signalState);
@@ -379,12 +1514,13 @@ extern "C" {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_ERROR_INVALID_PARAMETER;}
 
-		threadList[currThread].state = VM_THREAD_STATE_WAITING;
+		setThreadState(currThread, VM_THREAD_STATE_WAITING);
 
 		callBackDataStorage *cb = new callBackDataStorage();
 		cb->id = currThread;
 		cb->resultPtr = fd;
 
+		ioBatchBegin();
 		MachineFileOpen(filename, flags, mode, &fileCallBack, cb);
 		schedule(0);
 
@@ -392,6 +1528,10 @@ extern "C" {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_FAILURE;
 		}
+		if (writeBehindEnabled) {
+			struct stat status;
+			writeBehindRegular[*fd] = stat(filename, &status) == 0 && S_ISREG(status.st_mode);
+		}
 		MachineResumeSignals(&signalState);
 
 		return VM_STATUS_SUCCESS;
@@ -400,15 +1540,20 @@ extern "C" {
 	TVMStatus VMFileClose(int fd) {
 		TMachineSignalState signalState;
 		MachineSuspendSignals(&signalState);
-		threadList[currThread].state = VM_THREAD_STATE_WAITING;
+		// Buffered data is still written out, but its error is reported here
+		bool synced = writeBehindSync(fd);
+		writeBehindRelease(fd);
+		writeBehindRegular.erase(fd);
+		setThreadState(currThread, VM_THREAD_STATE_WAITING);
 		int result;
 		callBackDataStorage *cb = new callBackDataStorage();
 		cb->id = currThread;
 		cb->resultPtr = (int*)&result;
+		ioBatchBegin();
 		MachineFileClose(fd, &fileCallBack, cb);
 		schedule(0);
 
-		if (result < 0) {
+		if (result < 0 || !synced) {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_FAILURE;
 		}
@@ -425,14 +1570,13 @@ extern "C" {
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
 
-		threadList[currThread].state = VM_THREAD_STATE_WAITING;
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
 
-		callBackDataStorage *cb = new callBackDataStorage();;
-		cb->id = currThread;
-		cb->resultPtr = length;
+		*length = fileTransferBuffer(false, fd, (uint8_t*)data, *length, -1);
 
-		MachineFileRead(fd, data, *length, &fileCallBack, cb);
-		schedule(0);
 		if (*length < 0) {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_FAILURE;
@@ -450,13 +1594,18 @@ extern "C" {
 			return VM_STATUS_ERROR_INVALID_PARAMETER;
 		}
 
-		threadList[currThread].state = VM_THREAD_STATE_WAITING;
+		if (writeBehindEnabled) {
+			int buffered = writeBehindWrite(fd, (uint8_t*)data, *length);
+			if (buffered != WRITE_BEHIND_BYPASS) {
+				// A flush started here must not wait for the thread to block
+				ioBatchFlush();
+				MachineResumeSignals(&signalState);
+				return buffered == WRITE_BEHIND_BUFFERED ? VM_STATUS_SUCCESS : VM_STATUS_FAILURE;
+			}
+		}
+
+		*length = fileTransferBuffer(true, fd, (uint8_t*)data, *length, -1);
 
-		callBackDataStorage *cb = new callBackDataStorage();
-		cb->id = currThread;
-		cb->resultPtr = length;
-		MachineFileWrite(fd, data, *length, &fileCallBack, cb);
-		schedule(0);
 		if (*length < 0) {
 			MachineResumeSignals(&signalState);
 			return VM_STATUS_FAILURE;
@@ -466,18 +1615,133 @@ extern "C" {
 		return VM_STATUS_SUCCESS;
 	}
 
+	TVMStatus VMFileReadAt(int fd, void* data, int* length, TVMFileOffset offset) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		if (data == NULL || length == NULL || offset < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+
+		*length = fileTransferBuffer(false, fd, (uint8_t*)data, *length, offset);
+
+		if (*length < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+		MachineResumeSignals(&signalState);
+
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMFileWriteAt(int fd, void* data, int* length, TVMFileOffset offset) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		if (data == NULL || length == NULL || offset < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+
+		*length = fileTransferBuffer(true, fd, (uint8_t*)data, *length, offset);
+
+		if (*length < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+		MachineResumeSignals(&signalState);
+
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMFileReadV(int fd, SVMIOVectorRef vector, int count, int* length) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		int size = (vector == NULL || count <= 0) ? -1 : ioVectorLength(vector, count);
+		if (length == NULL || size < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+
+		*length = fileTransferVector(false, fd, vector, count, size);
+
+		if (*length < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+		MachineResumeSignals(&signalState);
+
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMFileWriteV(int fd, SVMIOVectorRef vector, int count, int* length) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		int size = (vector == NULL || count <= 0) ? -1 : ioVectorLength(vector, count);
+		if (length == NULL || size < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_PARAMETER;
+		}
+
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+
+		*length = fileTransferVector(true, fd, vector, count, size);
+
+		if (*length < 0) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+		MachineResumeSignals(&signalState);
+
+		return VM_STATUS_SUCCESS;
+	}
+
+	TVMStatus VMFileSync(int fd) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
+		MachineResumeSignals(&signalState);
+
+		return VM_STATUS_SUCCESS;
+	}
+
 	TVMStatus VMFileSeek(int fd, int offset, int whence, int* newoffset) {
 		TMachineSignalState signalState;
 		MachineSuspendSignals(&signalState);
+		if (!writeBehindSync(fd)) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_FAILURE;
+		}
 		int placeHolder = 0;
 		int* tempPointer = &placeHolder;
 
-		threadList[currThread].state = VM_THREAD_STATE_WAITING;
+		setThreadState(currThread, VM_THREAD_STATE_WAITING);
 
 		callBackDataStorage *cb = new callBackDataStorage();
 		cb->id = currThread;
 		cb->resultPtr = tempPointer;
 
+		ioBatchBegin();
 		MachineFileSeek(fd, offset, whence, &fileCallBack, cb);
 		schedule(0);
 
@@ -505,9 +1769,10 @@ extern "C" {
 		Mutex* mtx = new Mutex();
 
 		mtx->isLocked = false;
-		mtx->waitingQ.resize(3);
+		prioInit(&mtx->waitingQ);
 		mtx->mtxId = mutexList.size();
-		mtx->owner = VM_THRAED_ID_INVALID;
+		mtx->owner = VM_THREAD_ID_INVALID;
+		mtx->nextHeld = VM_MUTEX_ID_INVALID;
 		mutexList.push_back(*mtx);
 
 		*mutexref = mtx->mtxId;
@@ -572,28 +1837,76 @@ extern "C" {
 				MachineResumeSignals(&signalState);
 				return VM_STATUS_FAILURE;
 			} else {
-				mutexList[mutex].isLocked = true;
-				mutexList[mutex].owner = currThread;
+				mutexHold(mutex, currThread);
 				MachineResumeSignals(&signalState);
 				return VM_STATUS_SUCCESS;
 			}
 		}
 
 		if (mutexList[mutex].isLocked) {
-			if (timeout == VM_TIMEOUT_INFINITE) { threadList[currThread].mtxWaitTime = -1; }
-			else { threadList[currThread].mtxWaitTime = timeout; }
-			mutexList[mutex].waitingQ[threadList[currThread].prio-1].push((TVMThreadID)currThread);
-			threadList[currThread].state = VM_THREAD_STATE_WAITING;
+			prioPush(&mutexList[mutex].waitingQ, currThread);
+			threadList[currThread].waitMutex = mutex;
+			// The owner, and whatever it waits behind, runs at least at our priority
+			refreshPriority(mutexList[mutex].owner);
+			if (timeout != VM_TIMEOUT_INFINITE) {
+				// Deadline is relative to the tick count, which may be stale
+				syncTicks();
+				timerAdd(currThread, totalTickCount + timeout);
+			}
+			MachineTrace(MACHINE_TRACE_MUTEX_WAIT, currThread, mutex, mutexList[mutex].owner);
+			setThreadState(currThread, VM_THREAD_STATE_WAITING);
 			schedule(0);
+			// Ownership is handed over on release, otherwise the wait timed out
+			if (mutexList[mutex].owner != currThread) {
+				MachineResumeSignals(&signalState);
+				return VM_STATUS_FAILURE;
+			}
 		} else {
-			mutexList[mutex].isLocked = true;
-			mutexList[mutex].owner = currThread;
+			mutexHold(mutex, currThread);
 		}
 		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
 	}
 
 	TVMStatus VMMutexRelease(TVMMutexID mutex) {
+		TMachineSignalState signalState;
+		MachineSuspendSignals(&signalState);
+
+		if (mutex < 0 || mutex >= mutexList.size()) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_ID;
+		}
+
+		if (!mutexList[mutex].isLocked || mutexList[mutex].owner != currThread) {
+			MachineResumeSignals(&signalState);
+			return VM_STATUS_ERROR_INVALID_STATE;
+		}
+
+		// Ownership passes straight to the highest priority waiter, and
+		// anything inherited through this mutex goes with it
+		mutexDrop(mutex);
+		MachineTrace(MACHINE_TRACE_MUTEX_RELEASE, currThread, mutex, 0);
+		refreshPriority(currThread);
+		int highest = prioHighest(&mutexList[mutex].waitingQ);
+		if (highest >= 0) {
+			TVMThreadID next = prioPop(&mutexList[mutex].waitingQ, highest);
+			if (threadList[next].timerSlot >= 0) {
+				timerRemove(next);
+			}
+			threadList[next].waitMutex = VM_MUTEX_ID_INVALID;
+			mutexHold(mutex, next);
+			refreshPriority(next);
+			setThreadState(next, VM_THREAD_STATE_READY);
+			readyPush(next);
+		}
+		// Dropping an inherited priority can also let other threads in
+		if (readyHighest(thisCPU) > (int)threadList[currThread].prio) {
+			setThreadState(currThread, VM_THREAD_STATE_READY);
+			schedule(0);
+		} else {
+			updateTimer();
+		}
+		MachineResumeSignals(&signalState);
 		return VM_STATUS_SUCCESS;
 	}
 
@@ -20,6 +20,8 @@ extern "C" {
 #define VM_THREAD_PRIORITY_LOW                  ((TVMThreadPriority)0x01)
 #define VM_THREAD_PRIORITY_NORMAL               ((TVMThreadPriority)0x02)
 #define VM_THREAD_PRIORITY_HIGH                 ((TVMThreadPriority)0x03)
+// Any priority from LOW up to MAX can be given to VMThreadCreate
+#define VM_THREAD_PRIORITY_MAX                  ((TVMThreadPriority)0x3F)
                                                 
 #define VM_THREAD_ID_INVALID                    ((TVMThreadID)-1)
                                                 
@@ -28,6 +30,10 @@ extern "C" {
 #define VM_TIMEOUT_INFINITE                     ((TVMTick)0)
 #define VM_TIMEOUT_IMMEDIATE                    ((TVMTick)-1)
 
+#define VM_START_FLAG_HUGEPAGES                 0x01
+#define VM_START_FLAG_TICKLESS                  0x02
+#define VM_START_FLAG_WRITEBEHIND               0x04
+
 typedef unsigned int TVMMemorySize, *TVMMemorySizeRef;
 typedef unsigned int TVMStatus, *TVMStatusRef;
 typedef unsigned int TVMTick, *TVMTickRef;
@@ -36,13 +42,23 @@ typedef unsigned int TVMMutexID, *TVMMutexIDRef;
 typedef unsigned int TVMThreadPriority, *TVMThreadPriorityRef;  
 typedef unsigned int TVMThreadState, *TVMThreadStateRef;  
 typedef unsigned int TVMMemoryPoolID, *TVMMemoryPoolIDRef;
+typedef long long TVMFileOffset, *TVMFileOffsetRef;
+
+// One fragment of a VMFileReadV/VMFileWriteV transfer
+typedef struct{
+    void *DData;
+    int DLength;
+} SVMIOVector, *SVMIOVectorRef;
 
 typedef void (*TVMMainEntry)(int, char*[]);
 typedef void (*TVMThreadEntry)(void *);
 
-TVMStatus VMStart(int tickms, TVMMemorySize sharedsize, int argc, char *argv[]);
+// requestslots is the initial number of outstanding Machine requests, going
+// past it still works up to 65536 but is counted and reported at exit
+TVMStatus VMStart(int tickus, TVMMemorySize sharedsize, int requestslots, int pollus, int processors, unsigned int flags, int argc, char *argv[]);
 
 TVMStatus VMTickMS(int *tickmsref);
+TVMStatus VMTickUS(int *tickusref);
 TVMStatus VMTickCount(TVMTickRef tickref);
 
 TVMStatus VMThreadCreate(TVMThreadEntry entry, void *param, TVMMemorySize memsize, TVMThreadPriority prio, TVMThreadIDRef tid);
@@ -56,6 +72,8 @@ TVMStatus VMThreadSleep(TVMTick tick);
 TVMStatus VMMutexCreate(TVMMutexIDRef mutexref);
 TVMStatus VMMutexDelete(TVMMutexID mutex);
 TVMStatus VMMutexQuery(TVMMutexID mutex, TVMThreadIDRef ownerref);
+// Waits at most timeout ticks, VM_STATUS_FAILURE if the mutex was not
+// acquired in time
 TVMStatus VMMutexAcquire(TVMMutexID mutex, TVMTick timeout);     
 TVMStatus VMMutexRelease(TVMMutexID mutex);
 
@@ -66,6 +84,13 @@ TVMStatus VMFileOpen(const char *filename, int flags, int mode, int *filedescrip
 TVMStatus VMFileClose(int filedescriptor);      
 TVMStatus VMFileRead(int filedescriptor, void *data, int *length);
 TVMStatus VMFileWrite(int filedescriptor, void *data, int *length);
+TVMStatus VMFileReadAt(int filedescriptor, void *data, int *length, TVMFileOffset offset);
+TVMStatus VMFileWriteAt(int filedescriptor, void *data, int *length, TVMFileOffset offset);
+TVMStatus VMFileReadV(int filedescriptor, SVMIOVectorRef vector, int count, int *length);
+TVMStatus VMFileWriteV(int filedescriptor, SVMIOVectorRef vector, int count, int *length);
+// Writes out anything VMFileWrite has buffered for the descriptor when the
+// VM was started with VM_START_FLAG_WRITEBEHIND
+TVMStatus VMFileSync(int filedescriptor);
 TVMStatus VMFileSeek(int filedescriptor, int offset, int whence, int *newoffset);
 TVMStatus VMFilePrint(int filedescriptor, const char *format, ...);
 
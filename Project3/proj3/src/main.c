@@ -1,10 +1,139 @@
 #include "VirtualMachine.h" 	 	    		
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_JOB_ARGUMENTS   64
+
+typedef struct{
+    const char *DCommand;
+    pid_t DPID;
+    FILE *DOutput;
+    struct timespec DStart;
+} SJob, *SJobRef;
+
+// Runs one job in a forked child, the job is a module followed by its 
+// arguments separated by whitespace
+int RunJob(SJobRef job, int tickus, TVMMemorySize sharedsize, int requestslots, int pollus, int processors, unsigned int flags){
+    char *Arguments[MAX_JOB_ARGUMENTS + 1];
+    char *Command = strdup(job->DCommand);
+    char *Token;
+    int Count = 0;
+    
+    // Output is collected so jobs running side by side do not interleave
+    job->DOutput = tmpfile();
+    clock_gettime(CLOCK_MONOTONIC, &job->DStart);
+    fflush(stdout);
+    fflush(stderr);
+    job->DPID = fork();
+    if(0 > job->DPID){
+        free(Command);
+        return 0;
+    }
+    if(0 == job->DPID){
+        if(job->DOutput){
+            dup2(fileno(job->DOutput), STDOUT_FILENO);
+            dup2(fileno(job->DOutput), STDERR_FILENO);
+        }
+        Token = strtok(Command, " \t");
+        while(Token && (MAX_JOB_ARGUMENTS > Count)){
+            Arguments[Count++] = Token;
+            Token = strtok(NULL, " \t");
+        }
+        Arguments[Count] = NULL;
+        if(0 == Count){
+            _exit(1);
+        }
+        if(VM_STATUS_SUCCESS != VMStart(tickus, sharedsize, requestslots, pollus, processors, flags, Count, Arguments)){
+            fprintf(stderr,"Virtual Machine failed to start.\n");
+            _exit(1);
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+    free(Command);
+    return 1;
+}
+
+void FinishJob(SJobRef job, int status){
+    struct timespec EndTime;
+    char Buffer[4096];
+    size_t Length;
+    
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    printf("==> %s: %s in %lld ms\n", job->DCommand, WIFEXITED(status) && (0 == WEXITSTATUS(status)) ? "ok" : "failed", 
+            (EndTime.tv_sec - job->DStart.tv_sec) * 1000LL + (EndTime.tv_nsec - job->DStart.tv_nsec) / 1000000);
+    if(job->DOutput){
+        rewind(job->DOutput);
+        while(0 < (Length = fread(Buffer, 1, sizeof(Buffer), job->DOutput))){
+            fwrite(Buffer, 1, Length, stdout);
+        }
+        fclose(job->DOutput);
+        job->DOutput = NULL;
+    }
+    fflush(stdout);
+}
+
+// Runs the jobs at most jobslots at a time, every VM gets its own server 
+// process and private IPC so they only share the CPUs
+int RunJobs(int jobslots, const char **commands, int count, int tickus, TVMMemorySize sharedsize, int requestslots, int pollus, int processors, unsigned int flags){
+    SJobRef Jobs = (SJobRef)calloc(count, sizeof(SJob));
+    int Next = 0, Running = 0, Failed = 0, Status;
+    struct timespec StartTime, EndTime;
+    pid_t Finished;
+    
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    while((Next < count) || Running){
+        while((Next < count) && (Running < jobslots)){
+            Jobs[Next].DCommand = commands[Next];
+            if(RunJob(&Jobs[Next], tickus, sharedsize, requestslots, pollus, processors, flags)){
+                Running++;
+            }
+            else{
+                fprintf(stderr,"Failed to start job %s.\n", commands[Next]);
+                Failed++;
+            }
+            Next++;
+        }
+        if(!Running){
+            break;
+        }
+        Finished = wait(&Status);
+        if(0 > Finished){
+            break;
+        }
+        for(int Index = 0; Index < Next; Index++){
+            if(Jobs[Index].DPID == Finished){
+                FinishJob(&Jobs[Index], Status);
+                if(!WIFEXITED(Status) || WEXITSTATUS(Status)){
+                    Failed++;
+                }
+                Jobs[Index].DPID = 0;
+                Running--;
+                break;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &EndTime);
+    printf("%d jobs, %d failed, %d at a time in %lld ms\n", count, Failed, jobslots, 
+            (EndTime.tv_sec - StartTime.tv_sec) * 1000LL + (EndTime.tv_nsec - StartTime.tv_nsec) / 1000000);
+    free(Jobs);
+    return Failed ? 1 : 0;
+}
 
 int main(int argc, char *argv[]){
     int TickTimeMS = 100;
+    int TickTimeUS = 0;
     TVMMemorySize SharedSize = 0x4000;
+    int RequestSlots = 256;
+    int PollUS = 0;
+    int Processors = 1;
+    unsigned int StartFlags = 0;
+    int JobSlots = 0;
     int Offset = 1;
     
     while(Offset < argc){
@@ -23,6 +152,21 @@ int main(int argc, char *argv[]){
                 return 1;
             }
         }
+        else if(0 == strcmp(argv[Offset], "-T")){
+            // Tick time in us, overrides -t
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&TickTimeUS)){
+                fprintf(stderr,"Invalid parameter for -T of \"%s\".\n",argv[Offset]);
+                return 1;
+            }
+            if(0 >= TickTimeUS){
+                fprintf(stderr,"Invalid parameter for -T must be positive!\n"); 
+                return 1;
+            }
+        }
         else if(0 == strcmp(argv[Offset], "-s")){
             // Tick time in ms
             Offset++;
@@ -38,6 +182,86 @@ int main(int argc, char *argv[]){
                 return 1;
             }
         }
+        else if(0 == strcmp(argv[Offset], "-r")){
+            // Initial Machine request slots, more are taken into use when
+            // they are all in flight and that is reported at exit
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&RequestSlots)){
+                fprintf(stderr,"Invalid parameter for -r of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if((0 >= RequestSlots)||(0x10000 < RequestSlots)){
+                fprintf(stderr,"Invalid parameter for -r must be between 1 and 65536!\n");    
+                return 1;
+            }
+        }
+        else if(0 == strcmp(argv[Offset], "-p")){
+            // Poll for I/O completions, signal after this many us without a poll
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&PollUS)){
+                fprintf(stderr,"Invalid parameter for -p of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if(0 >= PollUS){
+                fprintf(stderr,"Invalid parameter for -p must be positive!\n");    
+                return 1;
+            }
+        }
+        else if(0 == strcmp(argv[Offset], "-H")){
+            // Back shared memory with hugepages
+            StartFlags |= VM_START_FLAG_HUGEPAGES;
+        }
+        else if(0 == strcmp(argv[Offset], "-n")){
+            // No periodic ticks unless threads contend
+            StartFlags |= VM_START_FLAG_TICKLESS;
+        }
+        else if(0 == strcmp(argv[Offset], "-w")){
+            // Buffer small writes until full, closed or synced
+            StartFlags |= VM_START_FLAG_WRITEBEHIND;
+        }
+        else if(0 == strcmp(argv[Offset], "-c")){
+            // Virtual processors to run threads on
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&Processors)){
+                fprintf(stderr,"Invalid parameter for -c of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if((0 >= Processors)||(64 < Processors)){
+                fprintf(stderr,"Invalid parameter for -c must be between 1 and 64!\n");    
+                return 1;
+            }
+        }
+        else if(0 == strcmp(argv[Offset], "-j")){
+            // Run each remaining argument as a job, this many at once
+            Offset++;
+            if(Offset >= argc){
+                break;   
+            }
+            if(1 != sscanf(argv[Offset],"%d",&JobSlots)){
+                fprintf(stderr,"Invalid parameter for -j of \"%s\".\n",argv[Offset]);    
+                return 1;
+            }
+            if(0 > JobSlots){
+                fprintf(stderr,"Invalid parameter for -j must not be negative!\n");    
+                return 1;
+            }
+            if(0 == JobSlots){
+                // Zero means one job per online CPU
+                JobSlots = sysconf(_SC_NPROCESSORS_ONLN);
+                if(0 >= JobSlots){
+                    JobSlots = 1;
+                }
+            }
+        }
         else{
             break;
         }
@@ -46,11 +270,22 @@ int main(int argc, char *argv[]){
     
     if(Offset >= argc){
         fprintf(stderr,"Syntax Error: vm [options] module [moduleoptions]\n");    
+        fprintf(stderr,"             vm [options] -j N \"module [moduleoptions]\" ...\n");    
         return 1;
     }
     
     
-    if(VM_STATUS_SUCCESS != VMStart(TickTimeMS, SharedSize, argc - Offset, argv + Offset)){
+    if(0 == TickTimeUS){
+        TickTimeUS = TickTimeMS * 1000;
+    }
+    if((1 < Processors)&&(PollUS || (StartFlags & VM_START_FLAG_TICKLESS))){
+        fprintf(stderr,"Invalid parameter -c cannot be combined with -p or -n!\n");    
+        return 1;
+    }
+    if(JobSlots){
+        return RunJobs(JobSlots, (const char **)(argv + Offset), argc - Offset, TickTimeUS, SharedSize, RequestSlots, PollUS, Processors, StartFlags);
+    }
+    if(VM_STATUS_SUCCESS != VMStart(TickTimeUS, SharedSize, RequestSlots, PollUS, Processors, StartFlags, argc - Offset, argv + Offset)){
         fprintf(stderr,"Virtual Machine failed to start.\n");    
         return 1;
     }